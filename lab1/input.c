@@ -0,0 +1,677 @@
+#define _GNU_SOURCE
+#include "input.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_BZLIB
+#include <bzlib.h>
+#endif
+#ifdef HAVE_LZMA
+#include <lzma.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#define BLOCK_SIZE (128 * 1024)
+#define RING_SLOTS 4
+#define MAGIC_MAX 10
+
+enum { FMT_NONE, FMT_GZIP, FMT_BZIP2, FMT_XZ, FMT_ZSTD };
+
+static const struct {
+  int fmt;
+  const char *magic;
+  size_t len;
+} formats[] = {
+#ifdef HAVE_ZLIB
+    {FMT_GZIP, "\x1f\x8b\x08\0", 4}, // deflate, then the flags
+#endif
+#ifdef HAVE_BZLIB
+    // Block size, then the magic of the first block or of the end of an
+    // empty stream.
+    {FMT_BZIP2, "BZh1\x31\x41\x59\x26\x53\x59", 10},
+    {FMT_BZIP2, "BZh1\x17\x72\x45\x38\x50\x90", 10},
+#endif
+#ifdef HAVE_LZMA
+    {FMT_XZ, "\xfd" "7zXZ\0\0\0", 8}, // then the stream flags
+#endif
+#ifdef HAVE_ZSTD
+    {FMT_ZSTD, "\x28\xb5\x2f\xfd\0", 5}, // then the frame header
+#endif
+    {FMT_NONE, "", 0},
+};
+
+// Compares the first n bytes of p with header i. Some bytes are only
+// partly fixed: the bzip2 block size digit, the gzip flags and the zstd
+// frame header descriptor, whose reserved bits are zero, and the xz
+// check type.
+static int header_match(int i, const unsigned char *p, size_t n) {
+  for (size_t k = 0; k < n && k < formats[i].len; k++) {
+    int fmt = formats[i].fmt;
+    unsigned char c = p[k];
+    if (fmt == FMT_BZIP2 && k == 3) {
+      if (c < '1' || c > '9')
+        return 0;
+    } else if (fmt == FMT_GZIP && k == 3) {
+      if (c & 0xe0)
+        return 0;
+    } else if (fmt == FMT_XZ && k == 7) {
+      if (c != 0x00 && c != 0x01 && c != 0x04 && c != 0x0a)
+        return 0;
+    } else if (fmt == FMT_ZSTD && k == 4) {
+      if (c & 0x08)
+        return 0;
+    } else if (c != (unsigned char)formats[i].magic[k]) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static int detect(const void *p, size_t n) {
+  for (int i = 0; formats[i].len; i++)
+    if (n >= formats[i].len && header_match(i, p, formats[i].len))
+      return formats[i].fmt;
+  return FMT_NONE;
+}
+
+int input_compressed(const void *p, size_t n) { return detect(p, n) != 0; }
+
+// Could more bytes still turn p into a header?
+static int magic_prefix(const void *p, size_t n) {
+  for (int i = 0; formats[i].len; i++)
+    if (n < formats[i].len && header_match(i, p, n))
+      return 1;
+  return 0;
+}
+
+// Decoding runs on its own thread, which fills a ring of RING_SLOTS
+// buffers of BLOCK_SIZE decoded bytes while the reader drains them, so
+// decompression overlaps with whatever the caller does with the data.
+// The compressed bytes come from the mapping of a regular file or are
+// read from the descriptor, after the ones input_open() already read.
+typedef struct Decoder {
+  pthread_t thread;
+  pthread_mutex_t mu;
+  pthread_cond_t cv;
+  int fmt;
+  int fd;
+  const unsigned char *src; // mapped input, or the read buffer
+  size_t src_len;
+  int src_eof;
+  unsigned char *inbuf;
+  struct {
+    char *buf;
+    size_t len;
+  } slot[RING_SLOTS];
+  unsigned filled, taken; // slots published and released
+  size_t pos;             // read offset in the oldest filled slot
+  int done, err, stop;
+
+  // Everything read from fd until the first decoded byte, to hand back
+  // if the data turns out not to be compressed after all.
+  unsigned char *raw;
+  size_t raw_len, raw_cap;
+  int output; // some bytes were decoded
+
+  int members; // complete gzip or bzip2 streams so far
+  int fresh;   // no output since the last stream started
+  int between; // a stream ended, the next has not started
+  union {
+#ifdef HAVE_ZLIB
+    z_stream z;
+#endif
+#ifdef HAVE_BZLIB
+    bz_stream bz;
+#endif
+#ifdef HAVE_LZMA
+    lzma_stream xz;
+#endif
+#ifdef HAVE_ZSTD
+    ZSTD_DStream *zs;
+#endif
+    int none;
+  } s;
+} Decoder;
+
+static int codec_init(Decoder *d) {
+  memset(&d->s, 0, sizeof(d->s));
+  d->fresh = 1;
+  switch (d->fmt) {
+#ifdef HAVE_ZLIB
+  case FMT_GZIP:
+    return inflateInit2(&d->s.z, 15 + 16) == Z_OK ? 0 : -1;
+#endif
+#ifdef HAVE_BZLIB
+  case FMT_BZIP2:
+    return BZ2_bzDecompressInit(&d->s.bz, 0, 0) == BZ_OK ? 0 : -1;
+#endif
+#ifdef HAVE_LZMA
+  case FMT_XZ: {
+    lzma_stream init = LZMA_STREAM_INIT;
+    d->s.xz = init;
+    return lzma_stream_decoder(&d->s.xz, UINT64_MAX, LZMA_CONCATENATED) ==
+                   LZMA_OK
+               ? 0
+               : -1;
+  }
+#endif
+#ifdef HAVE_ZSTD
+  case FMT_ZSTD:
+    d->s.zs = ZSTD_createDStream();
+    return d->s.zs && !ZSTD_isError(ZSTD_initDStream(d->s.zs)) ? 0 : -1;
+#endif
+  }
+  return -1;
+}
+
+static void codec_end(Decoder *d) {
+  switch (d->fmt) {
+#ifdef HAVE_ZLIB
+  case FMT_GZIP:
+    inflateEnd(&d->s.z);
+    break;
+#endif
+#ifdef HAVE_BZLIB
+  case FMT_BZIP2:
+    BZ2_bzDecompressEnd(&d->s.bz);
+    break;
+#endif
+#ifdef HAVE_LZMA
+  case FMT_XZ:
+    lzma_end(&d->s.xz);
+    break;
+#endif
+#ifdef HAVE_ZSTD
+  case FMT_ZSTD:
+    ZSTD_freeDStream(d->s.zs);
+    break;
+#endif
+  }
+}
+
+// Decodes from d->src into out. Returns 1 at the clean end of the data,
+// 0 to be called again and -1 on corrupt data. gzip and bzip2 files may
+// hold several streams back to back; bytes after the last one that do
+// not start another are ignored, as gzip does.
+static int codec_step(Decoder *d, char *out, size_t cap, size_t *produced) {
+  size_t in_len = d->src_len;
+  int r = 0;
+  (void)out; // unused when built without any decompressor
+  (void)cap;
+  *produced = 0;
+  if (d->between) {
+    if (in_len == 0)
+      return d->src_eof;
+    codec_end(d);
+    if (codec_init(d) < 0)
+      return -1;
+    d->between = 0;
+  }
+  switch (d->fmt) {
+#ifdef HAVE_ZLIB
+  case FMT_GZIP: {
+    z_stream *z = &d->s.z;
+    z->next_in = (unsigned char *)d->src;
+    z->avail_in = (uInt)in_len;
+    z->next_out = (unsigned char *)out;
+    z->avail_out = (uInt)cap;
+    int zr = inflate(z, Z_NO_FLUSH);
+    *produced = cap - z->avail_out;
+    in_len = z->avail_in;
+    if (zr == Z_STREAM_END)
+      r = 2;
+    else if (zr != Z_OK && zr != Z_BUF_ERROR)
+      r = -1;
+    break;
+  }
+#endif
+#ifdef HAVE_BZLIB
+  case FMT_BZIP2: {
+    bz_stream *bz = &d->s.bz;
+    bz->next_in = (char *)d->src;
+    bz->avail_in = (unsigned)in_len;
+    bz->next_out = out;
+    bz->avail_out = (unsigned)cap;
+    int br = BZ2_bzDecompress(bz);
+    *produced = cap - bz->avail_out;
+    in_len = bz->avail_in;
+    if (br == BZ_STREAM_END)
+      r = 2;
+    else if (br != BZ_OK)
+      r = -1;
+    break;
+  }
+#endif
+#ifdef HAVE_LZMA
+  case FMT_XZ: {
+    lzma_stream *xz = &d->s.xz;
+    xz->next_in = d->src;
+    xz->avail_in = in_len;
+    xz->next_out = (uint8_t *)out;
+    xz->avail_out = cap;
+    lzma_ret lr = lzma_code(xz, d->src_eof ? LZMA_FINISH : LZMA_RUN);
+    *produced = cap - xz->avail_out;
+    in_len = xz->avail_in;
+    if (lr == LZMA_STREAM_END)
+      r = 1;
+    else if (lr != LZMA_OK && lr != LZMA_BUF_ERROR)
+      r = -1;
+    break;
+  }
+#endif
+#ifdef HAVE_ZSTD
+  case FMT_ZSTD: {
+    ZSTD_inBuffer zin = {d->src, in_len, 0};
+    ZSTD_outBuffer zout = {out, cap, 0};
+    size_t zr = ZSTD_decompressStream(d->s.zs, &zout, &zin);
+    *produced = zout.pos;
+    in_len -= zin.pos;
+    if (ZSTD_isError(zr))
+      r = -1;
+    else if (zr == 0 && in_len == 0 && d->src_eof)
+      r = 1;
+    break;
+  }
+#endif
+  }
+  d->src += d->src_len - in_len;
+  d->src_len = in_len;
+  if (*produced)
+    d->fresh = 0;
+  if (r == -1 && d->fresh && d->members > 0)
+    return 1; // trailing garbage after the last stream
+  if (r == 2) {
+    d->members++;
+    d->between = 1;
+    r = d->src_len == 0 && d->src_eof;
+  }
+  return r;
+}
+
+// Refills d->src from the descriptor. Cancellation is only allowed
+// while blocked in read(), where no lock is held.
+static int dec_fill(Decoder *d) {
+  ssize_t r;
+  int old;
+  pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, &old);
+  do
+    r = read(d->fd, d->inbuf, BLOCK_SIZE);
+  while (r < 0 && errno == EINTR);
+  pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &old);
+  if (r < 0)
+    return -1;
+  d->src = d->inbuf;
+  d->src_len = (size_t)r;
+  d->src_eof = r == 0;
+  if (d->raw && d->raw_cap - d->raw_len < (size_t)r) {
+    size_t cap = d->raw_cap * 2 + (size_t)r;
+    unsigned char *raw = realloc(d->raw, cap);
+    if (!raw) {
+      free(d->raw); // no way back to the raw bytes, so decode or fail
+      d->raw = NULL;
+    } else {
+      d->raw = raw;
+      d->raw_cap = cap;
+    }
+  }
+  if (d->raw) {
+    memcpy(d->raw + d->raw_len, d->inbuf, (size_t)r);
+    d->raw_len += (size_t)r;
+  }
+  return 0;
+}
+
+static void dec_finish(Decoder *d, int err) {
+  pthread_mutex_lock(&d->mu);
+  d->done = 1;
+  d->err = err;
+  pthread_cond_broadcast(&d->cv);
+  pthread_mutex_unlock(&d->mu);
+}
+
+static void *dec_main(void *arg) {
+  Decoder *d = arg;
+  int old, end = 0;
+  pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &old);
+  while (!end) {
+    pthread_mutex_lock(&d->mu);
+    while (d->filled - d->taken == RING_SLOTS && !d->stop)
+      pthread_cond_wait(&d->cv, &d->mu);
+    int stop = d->stop;
+    pthread_mutex_unlock(&d->mu);
+    if (stop)
+      return NULL;
+
+    char *out = d->slot[d->filled % RING_SLOTS].buf;
+    size_t len = 0;
+    while (len < BLOCK_SIZE && !end) {
+      if (d->src_len == 0 && !d->src_eof && d->fd >= 0 && dec_fill(d) < 0) {
+        dec_finish(d, errno);
+        return NULL;
+      }
+      size_t produced;
+      const unsigned char *before = d->src;
+      int r = codec_step(d, out + len, BLOCK_SIZE - len, &produced);
+      len += produced;
+      if (produced && !d->output) {
+        d->output = 1;
+        free(d->raw);
+        d->raw = NULL;
+      }
+      if (r < 0 || (r == 0 && produced == 0 && d->src == before &&
+                    d->src_len == 0 && d->src_eof)) {
+        dec_finish(d, EBADMSG); // corrupt or truncated
+        return NULL;
+      }
+      end = r == 1;
+    }
+    pthread_mutex_lock(&d->mu);
+    d->slot[d->filled % RING_SLOTS].len = len;
+    d->filled++;
+    pthread_cond_broadcast(&d->cv);
+    pthread_mutex_unlock(&d->mu);
+  }
+  dec_finish(d, 0);
+  return NULL;
+}
+
+// Copies up to n decoded bytes to p; 0 at the end, -1 on error.
+static ssize_t dec_read(Decoder *d, char *p, size_t n) {
+  pthread_mutex_lock(&d->mu);
+  while (d->filled == d->taken && !d->done)
+    pthread_cond_wait(&d->cv, &d->mu);
+  if (d->filled == d->taken) {
+    int err = d->err;
+    pthread_mutex_unlock(&d->mu);
+    if (!err)
+      return 0;
+    errno = err;
+    return -1;
+  }
+  pthread_mutex_unlock(&d->mu);
+
+  // The oldest filled slot belongs to the reader until it is released.
+  unsigned i = d->taken % RING_SLOTS;
+  size_t left = d->slot[i].len - d->pos;
+  if (n > left)
+    n = left;
+  memcpy(p, d->slot[i].buf + d->pos, n);
+  d->pos += n;
+  if (d->pos == d->slot[i].len) {
+    d->pos = 0;
+    pthread_mutex_lock(&d->mu);
+    d->taken++;
+    pthread_cond_broadcast(&d->cv);
+    pthread_mutex_unlock(&d->mu);
+  }
+  return (ssize_t)n;
+}
+
+static void dec_free(Decoder *d) {
+  codec_end(d);
+  for (int i = 0; i < RING_SLOTS; i++)
+    free(d->slot[i].buf);
+  free(d->inbuf);
+  free(d->raw);
+  pthread_mutex_destroy(&d->mu);
+  pthread_cond_destroy(&d->cv);
+  free(d);
+}
+
+// Starts decoding src, followed by the rest of fd unless fd is -1.
+static Decoder *dec_start(int fmt, const void *src, size_t len, int fd) {
+  Decoder *d = calloc(1, sizeof(*d));
+  if (!d)
+    return NULL;
+  d->fmt = fmt;
+  d->fd = fd;
+  pthread_mutex_init(&d->mu, NULL);
+  pthread_cond_init(&d->cv, NULL);
+  int ok = codec_init(d) == 0;
+  for (int i = 0; ok && i < RING_SLOTS; i++)
+    ok = (d->slot[i].buf = malloc(BLOCK_SIZE)) != NULL;
+  if (ok && fd >= 0) {
+    ok = (d->inbuf = malloc(BLOCK_SIZE)) != NULL;
+    if (ok)
+      memcpy(d->inbuf, src, len);
+    src = d->inbuf;
+    if (ok && (d->raw = malloc(BLOCK_SIZE)) != NULL) {
+      memcpy(d->raw, src, len);
+      d->raw_len = len;
+      d->raw_cap = BLOCK_SIZE;
+    }
+  }
+  d->src = src;
+  d->src_len = len;
+  d->src_eof = fd < 0;
+  if (!ok || pthread_create(&d->thread, NULL, dec_main, d) != 0) {
+    dec_free(d);
+    return NULL;
+  }
+  return d;
+}
+
+// Maps the rest of a regular file starting at the current offset. Empty
+// files (and /proc files, which report size 0) are streamed instead.
+static int input_map(Input *in) {
+  struct stat st;
+  if (fstat(in->fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0)
+    return -1;
+  off_t pos = lseek(in->fd, 0, SEEK_CUR);
+  if (pos < 0 || pos >= st.st_size)
+    return -1;
+  off_t page = (off_t)sysconf(_SC_PAGESIZE);
+  off_t start = pos & ~(page - 1);
+  size_t len = (size_t)(st.st_size - start);
+  void *m = mmap(NULL, len, PROT_READ, MAP_PRIVATE, in->fd, start);
+  if (m == MAP_FAILED)
+    return -1;
+  madvise(m, len, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+  madvise(m, len, MADV_HUGEPAGE); // only honoured for some file systems
+#endif
+  in->map = m;
+  in->map_len = len;
+  in->data = in->map + (pos - start);
+  in->data_len = (size_t)(st.st_size - pos);
+  in->end = st.st_size;
+  return 0;
+}
+
+static ssize_t read_some(int fd, char *p, size_t n) {
+  ssize_t r;
+  do
+    r = read(fd, p, n);
+  while (r < 0 && errno == EINTR);
+  return r;
+}
+
+// Reads the start of a stream into buf, just far enough to tell whether
+// it is compressed, so a terminal is not kept waiting for more input.
+static void input_peek(Input *in) {
+  if (!(in->buf = malloc(BLOCK_SIZE))) {
+    in->err = ENOMEM;
+    return;
+  }
+  in->cap = BLOCK_SIZE;
+  do {
+    ssize_t r = read_some(in->fd, in->buf + in->pend, in->cap - in->pend);
+    if (r <= 0) {
+      if (r < 0)
+        in->err = errno;
+      else
+        in->eof = 1;
+      return;
+    }
+    in->pend += (size_t)r;
+  } while (in->pend < MAGIC_MAX && magic_prefix(in->buf, in->pend));
+}
+
+static void dec_stop(Decoder *d) {
+  pthread_mutex_lock(&d->mu);
+  d->stop = 1;
+  pthread_cond_broadcast(&d->cv);
+  pthread_mutex_unlock(&d->mu);
+  pthread_cancel(d->thread); // only acted on inside read()
+  pthread_join(d->thread, NULL);
+  dec_free(d);
+}
+
+// A header matched but the data did not decode before a single byte
+// came out: it is taken as it is instead. Returns 1 if the input was
+// switched back to the raw bytes.
+static int input_undecoded(Input *in) {
+  Decoder *d = in->dec;
+  if (errno != EBADMSG || d->output || (!in->map && !d->raw))
+    return 0;
+  if (in->map) {
+    in->data_len = (size_t)(in->map + in->map_len - in->data);
+  } else {
+    free(in->buf);
+    in->buf = (char *)d->raw;
+    in->cap = d->raw_cap;
+    in->pend = d->raw_len;
+    in->eof = d->src_eof;
+    d->raw = NULL;
+  }
+  in->dec = NULL;
+  dec_stop(d);
+  return 1;
+}
+
+void input_open(Input *in, int fd) {
+  memset(in, 0, sizeof(*in));
+  in->fd = fd;
+  if (input_map(in) == 0) {
+    int fmt = detect(in->data, in->data_len);
+    if (fmt && (in->dec = dec_start(fmt, in->data, in->data_len, -1))) {
+      in->data_len = 0;
+      lseek(in->fd, in->end, SEEK_SET); // as if it had been read
+    }
+    return;
+  }
+  input_peek(in);
+  int fmt = in->pend ? detect(in->buf, in->pend) : FMT_NONE;
+  if (fmt && (in->dec = dec_start(fmt, in->buf, in->pend, fd)))
+    in->pend = 0;
+}
+
+int input_decoding(const Input *in) { return in->dec != NULL; }
+
+size_t input_pending(Input *in, const char **p) {
+  size_t n = in->pend;
+  *p = in->buf;
+  in->pend = 0;
+  return n;
+}
+
+static ssize_t input_take_map(Input *in, const char **p) {
+  if (in->data_len == 0)
+    return 0;
+  *p = in->data;
+  ssize_t n = (ssize_t)in->data_len;
+  in->data_len = 0;
+  lseek(in->fd, in->end, SEEK_SET); // as if it had been read
+  return n;
+}
+
+static ssize_t source_read(Input *in, char *p, size_t n) {
+  if (in->dec)
+    return dec_read(in->dec, p, n);
+  if (in->err) {
+    errno = in->err;
+    return -1;
+  }
+  if (in->eof)
+    return 0;
+  return read_some(in->fd, p, n);
+}
+
+ssize_t input_read(Input *in, const char **p) {
+  if (in->map && !in->dec)
+    return input_take_map(in, p);
+  if (in->pend) {
+    *p = in->buf;
+    return (ssize_t)input_pending(in, p);
+  }
+  if (!in->buf) {
+    in->buf = malloc(BLOCK_SIZE);
+    if (!in->buf)
+      return -1;
+    in->cap = BLOCK_SIZE;
+  }
+  ssize_t r = source_read(in, in->buf, in->cap);
+  if (r < 0 && in->dec && input_undecoded(in))
+    return input_read(in, p);
+  if (r > 0)
+    *p = in->buf;
+  return r;
+}
+
+ssize_t input_lines(Input *in, const char **p) {
+  if (in->map && !in->dec)
+    return input_take_map(in, p);
+  // Move the unterminated tail of the last block to the front; it holds
+  // no newline. Bytes input_open() read are already at the front.
+  size_t len = in->keep, old = len;
+  if (len > 0 && in->cap > len)
+    memmove(in->buf, in->buf + in->cap - len, len);
+  in->keep = 0;
+  if (in->pend) {
+    len = in->pend;
+    old = 0;
+    in->pend = 0;
+  }
+  for (;;) {
+    const char *nl = len > old ? memrchr(in->buf + old, '\n', len - old) : NULL;
+    if (nl) {
+      size_t whole = (size_t)(nl + 1 - in->buf);
+      in->keep = len - whole;
+      // The tail is moved on the next call; park it at the end.
+      if (in->keep > 0)
+        memmove(in->buf + in->cap - in->keep, in->buf + whole, in->keep);
+      *p = in->buf;
+      return (ssize_t)whole;
+    }
+    if (in->eof) { // the last line may lack its newline
+      *p = in->buf;
+      return (ssize_t)len;
+    }
+    old = len;
+    if (len == in->cap) {
+      size_t cap = in->cap ? in->cap * 2 : BLOCK_SIZE;
+      char *b = realloc(in->buf, cap);
+      if (!b)
+        return -1;
+      in->buf = b;
+      in->cap = cap;
+    }
+    ssize_t r = source_read(in, in->buf + len, in->cap - len);
+    if (r < 0 && len == 0 && in->dec && input_undecoded(in))
+      return input_lines(in, p);
+    if (r < 0)
+      return -1;
+    if (r == 0)
+      in->eof = 1;
+    len += (size_t)r;
+  }
+}
+
+void input_close(Input *in) {
+  if (in->dec)
+    dec_stop(in->dec);
+  if (in->map)
+    munmap(in->map, in->map_len);
+  free(in->buf);
+  memset(in, 0, sizeof(*in));
+}
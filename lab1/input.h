@@ -0,0 +1,56 @@
+#ifndef LAB1_INPUT_H
+#define LAB1_INPUT_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+struct Decoder;
+
+// Input source shared by mycat and mygrep. Regular files are mapped and
+// handed out in one piece; pipes, terminals and other streams are read
+// in blocks into a private buffer. Compressed data (gzip, bzip2, xz and
+// zstd, as far as the libraries were available at build time) is
+// recognised by its header and decoded on a separate thread, and the
+// blocks are then the decoded bytes. Data that fails to decode before
+// yielding a byte is passed through as it is.
+typedef struct {
+  int fd;
+  char *map; // mapping of the file, page aligned
+  size_t map_len;
+  const char *data; // unread mapped bytes
+  size_t data_len;
+  off_t end; // file size, to leave the offset at EOF
+  char *buf; // streaming buffer
+  size_t cap;
+  size_t keep; // bytes carried over by input_lines()
+  size_t pend; // bytes read by input_open(), at the start of buf
+  int err;     // errno of a failed read in input_open()
+  int eof;
+  struct Decoder *dec;
+} Input;
+
+// Sets up reading from fd, which stays owned by the caller. A stream is
+// read from right away to look for a compression header.
+void input_open(Input *in, int fd);
+
+// Returns the next block of data through *p, 0 at end of input or -1 on
+// a read error (errno is set). The block stays valid until the next call.
+ssize_t input_read(Input *in, const char **p);
+
+// Like input_read(), but blocks always end after a newline except at
+// the end of input, so no line is split between two blocks.
+ssize_t input_lines(Input *in, const char **p);
+
+// Nonzero if the blocks are decoded from compressed data.
+int input_decoding(const Input *in);
+
+// Takes the bytes input_open() read from a stream, for a caller that
+// moves the rest of an uncompressed stream by other means.
+size_t input_pending(Input *in, const char **p);
+
+// Whether p starts with the header of a format that is decoded.
+int input_compressed(const void *p, size_t n);
+
+void input_close(Input *in);
+
+#endif
@@ -1,6 +1,21 @@
+#define _GNU_SOURCE
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "input.h"
+
+#define OUT_SIZE (256 * 1024)
+#define KERNEL_CHUNK (1 << 30)
+#define PAR_CHUNK (4 * 1024 * 1024)
+#define MAX_JOBS 256
+#define NUM_MAX 24 // a line number prefix and then some
 
 static long lineno = 1;
 
@@ -8,59 +23,391 @@ typedef struct {
   int number_all;      // -n
   int number_nonblank; // -b
   int show_ends;       // -E
+  int jobs;            // -j N
 } Options;
 
+// Output is collected here and written in large blocks.
+static char out_buf[OUT_SIZE];
+static size_t out_len;
+static int out_failed;
+
 static void usage(const char *prog) {
-  fprintf(stderr, "Usage: %s [-n] [-b] [-E] [FILE...]\n", prog);
+  fprintf(stderr, "Usage: %s [-n] [-b] [-E] [-j N] [FILE...]\n", prog);
 }
 
-static int cat_stream(FILE *fp, const char *name, const Options *opt) {
-  int c;
-  int at_line_start = 1;
-  int current_line_nonblank = 0;
+static int write_all(int fd, const char *p, size_t n) {
+  while (n > 0) {
+    ssize_t w = write(fd, p, n);
+    if (w < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    p += w;
+    n -= (size_t)w;
+  }
+  return 0;
+}
 
-  while ((c = fgetc(fp)) != EOF) {
-    if (at_line_start) {
-      current_line_nonblank = 0;
-
-      int d = c;
-      if (d != '\n')
-        current_line_nonblank = 1;
-
-      int need_number = 0;
-      if (opt->number_nonblank) {
-        if (current_line_nonblank)
-          need_number = 1;
-      } else if (opt->number_all) {
-        need_number = 1;
+static void out_flush(void) {
+  if (out_len > 0 && !out_failed &&
+      write_all(STDOUT_FILENO, out_buf, out_len) < 0) {
+    fprintf(stderr, "mycat: write error: %s\n", strerror(errno));
+    out_failed = 1;
+  }
+  out_len = 0;
+}
+
+static void out_put(const char *p, size_t n) {
+  if (n > OUT_SIZE - out_len) {
+    out_flush();
+    if (n >= OUT_SIZE) { // too big to be worth copying
+      if (!out_failed && write_all(STDOUT_FILENO, p, n) < 0) {
+        fprintf(stderr, "mycat: write error: %s\n", strerror(errno));
+        out_failed = 1;
       }
+      return;
+    }
+  }
+  memcpy(out_buf + out_len, p, n);
+  out_len += n;
+}
 
-      if (need_number) {
-        printf("%6ld\t", lineno++);
+// Same as sprintf(dst, "%6ld\t", n) without the NUL; dst must hold
+// NUM_MAX bytes. Returns the length.
+static size_t format_number(char *dst, long n) {
+  char tmp[NUM_MAX];
+  char *p = tmp + sizeof(tmp);
+  *--p = '\t';
+  int digits = 0;
+  do {
+    *--p = (char)('0' + n % 10);
+    n /= 10;
+    digits++;
+  } while (n > 0);
+  while (digits++ < 6)
+    *--p = ' ';
+  size_t len = (size_t)(tmp + sizeof(tmp) - p);
+  memcpy(dst, p, len);
+  return len;
+}
+
+static void out_number(long n) {
+  char num[NUM_MAX];
+  out_put(num, format_number(num, n));
+}
+
+// Errors that only mean "this pair of files cannot be copied this way".
+static int kernel_copy_refused(int err) {
+  return err == EINVAL || err == ENOSYS || err == EXDEV || err == EBADF ||
+         err == EOPNOTSUPP || err == ESPIPE;
+}
+
+// Copies fd to stdout without passing the data through user space:
+// copy_file_range between regular files, splice when either side is a
+// pipe, sendfile otherwise. Returns 1 if the kernel refused before any
+// byte moved (use the buffered path), 0 when done, -1 on error.
+static int cat_zero_copy(int fd, const char *name) {
+  struct stat in_st, out_st;
+  if (fstat(fd, &in_st) < 0 || fstat(STDOUT_FILENO, &out_st) < 0)
+    return 1;
+  enum { CFR, SPLICE, SENDFILE } how = SENDFILE;
+  if (S_ISREG(in_st.st_mode) && S_ISREG(out_st.st_mode))
+    how = CFR;
+  else if (S_ISFIFO(in_st.st_mode) || S_ISFIFO(out_st.st_mode))
+    how = SPLICE;
+  else if (!S_ISREG(in_st.st_mode))
+    return 1; // sendfile needs a mappable source
+
+  int moved = 0;
+  for (;;) {
+    ssize_t n;
+    if (how == CFR)
+      n = copy_file_range(fd, NULL, STDOUT_FILENO, NULL, KERNEL_CHUNK, 0);
+    else if (how == SPLICE)
+      n = splice(fd, NULL, STDOUT_FILENO, NULL, KERNEL_CHUNK,
+                 SPLICE_F_MOVE | SPLICE_F_MORE);
+    else
+      n = sendfile(STDOUT_FILENO, fd, NULL, KERNEL_CHUNK);
+    if (n == 0)
+      return 0;
+    if (n > 0) {
+      moved = 1;
+      continue;
+    }
+    if (errno == EINTR)
+      continue;
+    if (!moved && kernel_copy_refused(errno))
+      return 1;
+    fprintf(stderr, "mycat: copy error on %s: %s\n", name ? name : "stdin",
+            strerror(errno));
+    return -1;
+  }
+}
+
+// Parallel numbering of regular files. The file is processed in rounds
+// of one PAR_CHUNK per thread: each thread reads its chunk and counts
+// the lines it will number, a prefix sum over the counts gives every
+// chunk its first line number, and the threads then format their chunks
+// into private buffers that are written out in order. The output is
+// identical to the serial engine.
+typedef struct {
+  int fd;
+  const Options *opt;
+  off_t off;
+  size_t len;
+  int at_line_start; // state left by the previous byte of the file
+  long first;        // number of the first line numbered in this chunk
+  long count;        // lines numbered after the first byte
+  int head;          // the first byte would start a numbered line
+  char *in;
+  char *out;
+  size_t out_len, out_cap;
+  int err;
+} Chunk;
+
+static int chunk_reserve(Chunk *c, size_t n) {
+  if (c->out_cap - c->out_len >= n)
+    return 0;
+  size_t cap = c->out_cap ? c->out_cap : 4096;
+  while (cap - c->out_len < n)
+    cap *= 2;
+  char *p = realloc(c->out, cap);
+  if (!p)
+    return -1;
+  c->out = p;
+  c->out_cap = cap;
+  return 0;
+}
+
+static void *chunk_count(void *arg) {
+  Chunk *c = arg;
+  size_t got = 0;
+  while (got < c->len) {
+    ssize_t r = pread(c->fd, c->in + got, c->len - got, c->off + got);
+    if (r <= 0) {
+      if (r < 0 && errno == EINTR)
+        continue;
+      c->err = r < 0 ? errno : EIO; // the file shrank under us
+      return NULL;
+    }
+    got += (size_t)r;
+  }
+  // Whether the chunk starts a line depends on the previous chunk, which
+  // is read concurrently: the first byte is accounted for by the caller.
+  const char *p = c->in;
+  const char *end = c->in + c->len;
+  c->head = c->opt->number_all || *p != '\n';
+  c->count = 0;
+  while ((p = memchr(p, '\n', (size_t)(end - p))) != NULL && ++p < end)
+    if (c->opt->number_all || *p != '\n')
+      c->count++;
+  return NULL;
+}
+
+static void *chunk_format(void *arg) {
+  Chunk *c = arg;
+  const Options *opt = c->opt;
+  const char *p = c->in;
+  const char *end = c->in + c->len;
+  int at_line_start = c->at_line_start;
+  long n = c->first;
+  c->out_len = 0;
+  while (p < end) {
+    if (at_line_start) {
+      if (opt->number_all || (opt->number_nonblank && *p != '\n')) {
+        if (chunk_reserve(c, NUM_MAX) < 0)
+          goto oom;
+        c->out_len += format_number(c->out + c->out_len, n++);
       }
       at_line_start = 0;
     }
+    const char *nl = memchr(p, '\n', (size_t)(end - p));
+    size_t seg = nl ? (size_t)(nl - p) : (size_t)(end - p);
+    if (chunk_reserve(c, seg + 2) < 0)
+      goto oom;
+    memcpy(c->out + c->out_len, p, seg);
+    c->out_len += seg;
+    if (!nl)
+      break;
+    if (opt->show_ends)
+      c->out[c->out_len++] = '$';
+    c->out[c->out_len++] = '\n';
+    p = nl + 1;
+    at_line_start = 1;
+  }
+  return NULL;
+oom:
+  c->err = ENOMEM;
+  return NULL;
+}
 
-    if (c == '\n') {
-      if (opt->show_ends)
-        putchar('$');
-      putchar('\n');
-      at_line_start = 1;
-    } else {
-      putchar(c);
-    }
+// Runs fn on every chunk, one thread each. Falls back to the calling
+// thread if a thread cannot be started.
+static void run_chunks(Chunk *chunks, int n, void *(*fn)(void *)) {
+  pthread_t th[MAX_JOBS];
+  int started[MAX_JOBS];
+  for (int t = 0; t < n; t++) {
+    started[t] = pthread_create(&th[t], NULL, fn, &chunks[t]) == 0;
+    if (!started[t])
+      fn(&chunks[t]);
   }
+  for (int t = 0; t < n; t++)
+    if (started[t])
+      pthread_join(th[t], NULL);
+}
 
-  if (ferror(fp)) {
-    fprintf(stderr, "mycat: read error on %s: %s\n", name ? name : "stdin",
-            strerror(errno));
+// Returns 1 if the file should go through the serial engine instead.
+static int cat_parallel(int fd, const char *name, const Options *opt) {
+  struct stat st;
+  if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) ||
+      st.st_size < 2 * (off_t)PAR_CHUNK)
+    return 1;
+  off_t pos = lseek(fd, 0, SEEK_CUR);
+  if (pos < 0)
     return 1;
+  Chunk chunks[MAX_JOBS];
+  memset(chunks, 0, sizeof(chunks));
+  int rc = 0;
+  for (int t = 0; t < opt->jobs; t++) {
+    chunks[t].fd = fd;
+    chunks[t].opt = opt;
+    chunks[t].in = malloc(PAR_CHUNK);
+    if (!chunks[t].in) {
+      fprintf(stderr, "mycat: out of memory\n");
+      rc = -1;
+      break;
+    }
   }
-  return 0;
+  int at_line_start = 1; // a new stream starts a new line
+  out_flush();
+  while (rc == 0 && pos < st.st_size) {
+    int n = 0;
+    for (; n < opt->jobs && pos < st.st_size; n++) {
+      Chunk *c = &chunks[n];
+      c->off = pos;
+      c->len = st.st_size - pos < PAR_CHUNK ? (size_t)(st.st_size - pos)
+                                            : PAR_CHUNK;
+      c->err = 0;
+      pos += (off_t)c->len;
+    }
+    run_chunks(chunks, n, chunk_count);
+    for (int t = 0; t < n; t++) {
+      Chunk *c = &chunks[t];
+      if (c->err) {
+        fprintf(stderr, "mycat: read error on %s: %s\n", name,
+                strerror(c->err));
+        rc = -1;
+        break;
+      }
+      c->at_line_start = at_line_start;
+      c->first = lineno;
+      lineno += c->count + (at_line_start && c->head);
+      at_line_start = c->in[c->len - 1] == '\n';
+    }
+    if (rc < 0)
+      break;
+    run_chunks(chunks, n, chunk_format);
+    for (int t = 0; t < n; t++) {
+      if (chunks[t].err) {
+        fprintf(stderr, "mycat: out of memory\n");
+        rc = -1;
+        break;
+      }
+      out_put(chunks[t].out, chunks[t].out_len);
+    }
+  }
+  for (int t = 0; t < opt->jobs; t++) {
+    free(chunks[t].in);
+    free(chunks[t].out);
+  }
+  out_flush();
+  if (rc == 0)
+    lseek(fd, st.st_size, SEEK_SET);
+  return rc < 0 || out_failed ? -1 : 0;
+}
+
+// Takes the input in large blocks (all of it at once for a mapped regular
+// file) and finds line ends with memchr, so the cost per byte is a memcpy
+// into the output buffer. Without any option the data is moved by the
+// kernel when possible, else the blocks are written out untouched.
+static int cat_stream(int fd, const char *name, const Options *opt) {
+  int decorate = opt->number_all || opt->number_nonblank || opt->show_ends;
+  int at_line_start = 1;
+  ssize_t r;
+
+  // What arrives from a terminal or a pipe such as tail -f is written
+  // out block by block rather than once the buffer is full.
+  struct stat st;
+  int live = fstat(fd, &st) < 0 || !S_ISREG(st.st_mode);
+
+  // Compressed input always goes through the decoder. Otherwise the
+  // bytes input_open() read to find that out are written first, and the
+  // kernel moves the rest.
+  Input in;
+  const char *block;
+  input_open(&in, fd);
+  if (!decorate && !input_decoding(&in)) {
+    size_t head = input_pending(&in, &block);
+    if (head)
+      out_put(block, head);
+    out_flush();
+    int zc = cat_zero_copy(fd, name);
+    if (zc <= 0) {
+      input_close(&in);
+      return zc < 0 || out_failed;
+    }
+  } else if (opt->jobs > 1 && name && !input_decoding(&in)) {
+    int pc = cat_parallel(fd, name, opt);
+    if (pc <= 0) {
+      input_close(&in);
+      return pc < 0;
+    }
+  }
+
+  while ((r = input_read(&in, &block)) != 0) {
+    if (r < 0) {
+      out_flush();
+      fprintf(stderr, "mycat: read error on %s: %s\n",
+              name ? name : "stdin", strerror(errno));
+      input_close(&in);
+      return 1;
+    }
+    const char *p = block;
+    const char *end = block + r;
+    if (!decorate) {
+      out_put(p, (size_t)r);
+      p = end;
+    }
+    while (p < end) {
+      if (at_line_start) {
+        if (opt->number_all || (opt->number_nonblank && *p != '\n'))
+          out_number(lineno++);
+        at_line_start = 0;
+      }
+      const char *nl = memchr(p, '\n', (size_t)(end - p));
+      if (!nl) {
+        out_put(p, (size_t)(end - p));
+        break;
+      }
+      out_put(p, (size_t)(nl - p));
+      if (opt->show_ends)
+        out_put("$\n", 2);
+      else
+        out_put("\n", 1);
+      p = nl + 1;
+      at_line_start = 1;
+    }
+    if (live)
+      out_flush();
+  }
+  input_close(&in);
+  out_flush();
+  return out_failed;
 }
 
 int main(int argc, char **argv) {
-  Options opt = {0, 0, 0};
+  Options opt = {0, 0, 0, 1};
   int i = 1;
 
   while (i < argc && argv[i][0] == '-' && argv[i][1] != '\0') {
@@ -76,7 +423,15 @@ int main(int argc, char **argv) {
         opt.number_nonblank = 1;
       else if (argv[i][j] == 'E')
         opt.show_ends = 1;
-      else {
+      else if (argv[i][j] == 'j') {
+        const char *arg = argv[i][j + 1] ? &argv[i][j + 1] : argv[++i];
+        opt.jobs = arg ? atoi(arg) : 0;
+        if (opt.jobs < 1 || opt.jobs > MAX_JOBS) {
+          usage(argv[0]);
+          return 2;
+        }
+        break;
+      } else {
         usage(argv[0]);
         return 2;
       }
@@ -91,22 +446,21 @@ int main(int argc, char **argv) {
 
   if (i == argc) {
     // stdin
-    status |= cat_stream(stdin, NULL, &opt);
+    status |= cat_stream(STDIN_FILENO, NULL, &opt);
   } else {
     for (; i < argc; i++) {
       if (strcmp(argv[i], "-") == 0) {
-        status |= cat_stream(stdin, NULL, &opt);
-        clearerr(stdin);
+        status |= cat_stream(STDIN_FILENO, NULL, &opt);
       } else {
-        FILE *fp = fopen(argv[i], "rb");
-        if (!fp) {
+        int fd = open(argv[i], O_RDONLY);
+        if (fd < 0) {
           fprintf(stderr, "mycat: cannot open %s: %s\n", argv[i],
                   strerror(errno));
           status = 1;
           continue;
         }
-        status |= cat_stream(fp, argv[i], &opt);
-        fclose(fp);
+        status |= cat_stream(fd, argv[i], &opt);
+        close(fd);
       }
     }
   }
@@ -1,61 +1,2331 @@
+#define _GNU_SOURCE
+#include <ctype.h>
 #include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
 
-static void usage(const char *prog) {
-  fprintf(stderr, "Usage: %s PATTERN [FILE...]\n", prog);
+#include "input.h"
+
+// Substring search over whole blocks. The vector kernels compare the
+// first and last byte of the needle against 16 or 32 positions at once
+// and only run memcmp where both agree, which in text is rare.
+typedef const char *(*find_fn)(const char *hay, size_t n, const char *needle,
+                               size_t m);
+
+static const char *find_scalar(const char *hay, size_t n, const char *needle,
+                               size_t m) {
+  if (m > n)
+    return NULL;
+  const char *end = hay + n - m + 1;
+  const char *p = hay;
+  while ((p = memchr(p, needle[0], (size_t)(end - p))) != NULL) {
+    if (p[m - 1] == needle[m - 1] && memcmp(p + 1, needle + 1, m - 1) == 0)
+      return p;
+    p++;
+  }
+  return NULL;
 }
 
-static int grep_stream(FILE *fp, const char *name, const char *pattern) {
-  size_t cap = 0;
-  char *line = NULL;
+#ifdef HAVE_X86_SIMD
+static const char *find_sse2(const char *hay, size_t n, const char *needle,
+                             size_t m) {
+  if (m < 2 || m > n)
+    return find_scalar(hay, n, needle, m);
+  const __m128i first = _mm_set1_epi8(needle[0]);
+  const __m128i last = _mm_set1_epi8(needle[m - 1]);
+  size_t i = 0;
+  for (; i + m - 1 + 16 <= n; i += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i *)(hay + i));
+    __m128i b = _mm_loadu_si128((const __m128i *)(hay + i + m - 1));
+    unsigned mask = (unsigned)_mm_movemask_epi8(
+        _mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+    while (mask) {
+      unsigned bit = (unsigned)__builtin_ctz(mask);
+      if (memcmp(hay + i + bit + 1, needle + 1, m - 2) == 0)
+        return hay + i + bit;
+      mask &= mask - 1;
+    }
+  }
+  return find_scalar(hay + i, n - i, needle, m);
+}
+
+__attribute__((target("avx2"))) static const char *
+find_avx2(const char *hay, size_t n, const char *needle, size_t m) {
+  if (m < 2 || m > n)
+    return find_scalar(hay, n, needle, m);
+  const __m256i first = _mm256_set1_epi8(needle[0]);
+  const __m256i last = _mm256_set1_epi8(needle[m - 1]);
+  size_t i = 0;
+  for (; i + m - 1 + 32 <= n; i += 32) {
+    __m256i a = _mm256_loadu_si256((const __m256i *)(hay + i));
+    __m256i b = _mm256_loadu_si256((const __m256i *)(hay + i + m - 1));
+    unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_and_si256(
+        _mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last)));
+    while (mask) {
+      unsigned bit = (unsigned)__builtin_ctz(mask);
+      if (memcmp(hay + i + bit + 1, needle + 1, m - 2) == 0)
+        return hay + i + bit;
+      mask &= mask - 1;
+    }
+  }
+  return find_scalar(hay + i, n - i, needle, m);
+}
+#endif
+
+static find_fn pick_find(void) {
+#ifdef HAVE_X86_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    return find_avx2;
+  return find_sse2;
+#else
+  return find_scalar;
+#endif
+}
+
+static find_fn find;
+
+// Multi-pattern search: a byte-indexed Aho-Corasick automaton with the
+// failure links folded into the transition table, so the scan is one
+// table lookup per input byte however many patterns there are. No
+// pattern contains a newline, so every line starts back at the root.
+typedef struct {
+  uint32_t *delta; // nstates * 256
+  uint8_t *out;    // state completes some pattern
+  size_t nstates, cap;
+} Aho;
+
+static int aho_grow(Aho *a) {
+  if (a->nstates < a->cap)
+    return 0;
+  size_t cap = a->cap ? a->cap * 2 : 256;
+  uint32_t *delta = realloc(a->delta, cap * 256 * sizeof(*delta));
+  if (!delta)
+    return -1;
+  a->delta = delta;
+  uint8_t *out = realloc(a->out, cap);
+  if (!out)
+    return -1;
+  a->out = out;
+  memset(a->delta + a->cap * 256, 0, (cap - a->cap) * 256 * sizeof(*delta));
+  memset(a->out + a->cap, 0, cap - a->cap);
+  a->cap = cap;
+  return 0;
+}
+
+static int aho_build(Aho *a, char **pats, size_t npats) {
+  memset(a, 0, sizeof(*a));
+  if (aho_grow(a) < 0)
+    return -1;
+  a->nstates = 1;
+  for (size_t i = 0; i < npats; i++) {
+    uint32_t s = 0;
+    for (const unsigned char *p = (const unsigned char *)pats[i]; *p; p++) {
+      if (!a->delta[s * 256 + *p]) {
+        if (aho_grow(a) < 0)
+          return -1;
+        a->delta[s * 256 + *p] = (uint32_t)a->nstates++;
+      }
+      s = a->delta[s * 256 + *p];
+    }
+    a->out[s] = 1;
+  }
+
+  // Breadth first, so a state's failure target is complete before it is
+  // used; missing edges are copied from the failure target's row.
+  uint32_t *fail = calloc(a->nstates, sizeof(*fail));
+  uint32_t *queue = malloc(a->nstates * sizeof(*queue));
+  if (!fail || !queue) {
+    free(fail);
+    free(queue);
+    return -1;
+  }
+  size_t head = 0, tail = 0;
+  for (int c = 0; c < 256; c++)
+    if (a->delta[c])
+      queue[tail++] = a->delta[c];
+  while (head < tail) {
+    uint32_t s = queue[head++];
+    a->out[s] |= a->out[fail[s]];
+    for (int c = 0; c < 256; c++) {
+      uint32_t t = a->delta[s * 256 + c];
+      uint32_t f = a->delta[fail[s] * 256 + c];
+      if (t) {
+        fail[t] = f;
+        queue[tail++] = t;
+      } else {
+        a->delta[s * 256 + c] = f;
+      }
+    }
+  }
+  free(fail);
+  free(queue);
+  return 0;
+}
+
+// Regex mode: POSIX extended syntax is compiled to a Thompson NFA, and
+// DFA states (sets of NFA nodes) are built lazily the first time a
+// transition is taken. The cache is dropped and rebuilt when it grows
+// past DFA_MAX_STATES, so pathological patterns cost time, not memory.
+#define DFA_MAX_STATES 4096
+#define RE_MAX_REPEAT 255
+
+enum { N_SET, N_SPLIT, N_EPS, N_BOL, N_EOL, N_MATCH };
+
+typedef struct {
+  int type;
+  int out, out1;
+  uint32_t set[8]; // N_SET: accepted bytes
+} Node;
+
+typedef struct {
+  int start, end; // end is an N_EPS node whose out is still open
+} Frag;
+
+typedef struct {
+  int *set; // sorted NFA nodes
   size_t n;
+  int trans[256]; // -1 until computed
+  int accept;     // a match ends here
+  int accept_eol; // a match ends here if the line ends here
+} Dstate;
+
+typedef struct {
+  Node *nodes;
+  size_t nnodes, cap;
+  int start, match;
+  const char *p, *end; // parse cursor
+  const char *err;
+
+  Dstate *st;
+  size_t nst;
+  int *hash; // open addressing, state index + 1
+  size_t hcap;
+  int init;
+  int *seed, *work, *stack;
+  unsigned *mark, gen;
+} Regex;
+
+static int re_node(Regex *r, int type) {
+  if (r->nnodes == r->cap) {
+    size_t cap = r->cap ? r->cap * 2 : 64;
+    Node *nodes = realloc(r->nodes, cap * sizeof(*nodes));
+    if (!nodes) {
+      r->err = "out of memory";
+      return -1;
+    }
+    r->nodes = nodes;
+    r->cap = cap;
+  }
+  Node *n = &r->nodes[r->nnodes];
+  memset(n, 0, sizeof(*n));
+  n->type = type;
+  n->out = n->out1 = -1;
+  return (int)r->nnodes++;
+}
+
+static int re_frag(Regex *r, int type, Frag *f) {
+  int n = re_node(r, type);
+  int e = re_node(r, N_EPS);
+  if (n < 0 || e < 0)
+    return -1;
+  r->nodes[n].out = e;
+  f->start = n;
+  f->end = e;
+  return 0;
+}
+
+static int re_empty(Regex *r, Frag *f) {
+  int e = re_node(r, N_EPS);
+  if (e < 0)
+    return -1;
+  f->start = f->end = e;
+  return 0;
+}
+
+static void re_cat(Regex *r, Frag *a, const Frag *b) {
+  r->nodes[a->end].out = b->start;
+  a->end = b->end;
+}
+
+static int re_alt(Regex *r, Frag *a, const Frag *b) {
+  int s = re_node(r, N_SPLIT);
+  int e = re_node(r, N_EPS);
+  if (s < 0 || e < 0)
+    return -1;
+  r->nodes[s].out = a->start;
+  r->nodes[s].out1 = b->start;
+  r->nodes[a->end].out = e;
+  r->nodes[b->end].out = e;
+  a->start = s;
+  a->end = e;
+  return 0;
+}
+
+// '*', '+' or '?' applied to f in place.
+static int re_repeat(Regex *r, Frag *f, int op) {
+  int s = re_node(r, N_SPLIT);
+  int e = re_node(r, N_EPS);
+  if (s < 0 || e < 0)
+    return -1;
+  r->nodes[s].out = f->start;
+  r->nodes[s].out1 = e;
+  r->nodes[f->end].out = op == '?' ? e : s;
+  if (op != '+')
+    f->start = s;
+  f->end = e;
+  return 0;
+}
+
+static void set_add(uint32_t *set, unsigned c) {
+  set[c >> 5] |= 1u << (c & 31);
+}
+
+static int set_has(const uint32_t *set, unsigned c) {
+  return (set[c >> 5] >> (c & 31)) & 1;
+}
+
+static const struct {
+  const char *name;
+  int (*fn)(int);
+} re_classes[] = {
+    {"alnum", isalnum}, {"alpha", isalpha}, {"blank", isblank},
+    {"cntrl", iscntrl}, {"digit", isdigit}, {"graph", isgraph},
+    {"lower", islower}, {"print", isprint}, {"punct", ispunct},
+    {"space", isspace}, {"upper", isupper}, {"xdigit", isxdigit},
+};
+
+static int re_bracket(Regex *r, uint32_t *set) {
+  int negate = 0, first = 1;
+  if (r->p < r->end && *r->p == '^') {
+    negate = 1;
+    r->p++;
+  }
+  for (;;) {
+    if (r->p >= r->end) {
+      r->err = "unmatched [";
+      return -1;
+    }
+    unsigned char c = (unsigned char)*r->p;
+    if (c == ']' && !first) {
+      r->p++;
+      break;
+    }
+    first = 0;
+    if (c == '[' && r->p + 1 < r->end && r->p[1] == ':') {
+      const char *name = r->p + 2;
+      const char *close = memmem(name, (size_t)(r->end - name), ":]", 2);
+      size_t i, len = close ? (size_t)(close - name) : 0;
+      for (i = 0; close && i < sizeof(re_classes) / sizeof(re_classes[0]); i++)
+        if (strlen(re_classes[i].name) == len &&
+            memcmp(re_classes[i].name, name, len) == 0)
+          break;
+      if (!close || i == sizeof(re_classes) / sizeof(re_classes[0])) {
+        r->err = "invalid character class";
+        return -1;
+      }
+      for (int b = 0; b < 256; b++)
+        if (re_classes[i].fn(b))
+          set_add(set, (unsigned)b);
+      r->p = close + 2;
+      continue;
+    }
+    r->p++;
+    unsigned hi = c;
+    if (r->p + 1 < r->end && *r->p == '-' && r->p[1] != ']') {
+      hi = (unsigned char)r->p[1];
+      r->p += 2;
+      if (hi < c) {
+        r->err = "invalid range end";
+        return -1;
+      }
+    }
+    for (unsigned b = c; b <= hi; b++)
+      set_add(set, b);
+  }
+  if (negate) {
+    for (int i = 0; i < 8; i++)
+      set[i] = ~set[i];
+    set[0] &= ~(1u << '\n');
+  }
+  return 0;
+}
+
+// \w \s \d and their complements; any other escaped byte is literal.
+static void re_escape(uint32_t *set, unsigned char c) {
+  int (*fn)(int);
+  switch (c) {
+  case 'w':
+  case 'W':
+    fn = isalnum;
+    break;
+  case 's':
+  case 'S':
+    fn = isspace;
+    break;
+  case 'd':
+  case 'D':
+    fn = isdigit;
+    break;
+  default:
+    set_add(set, c);
+    return;
+  }
+  int negate = isupper(c) != 0;
+  for (int b = 0; b < 256; b++) {
+    int in = fn(b) || ((c | 0x20) == 'w' && b == '_');
+    if (b != '\n' && in != negate)
+      set_add(set, (unsigned)b);
+  }
+}
+
+static int re_alternation(Regex *r, Frag *f, int depth);
+
+static int re_atom(Regex *r, Frag *f, int depth) {
+  unsigned char c = (unsigned char)*r->p++;
+  switch (c) {
+  case '(':
+    if (re_alternation(r, f, depth + 1) < 0)
+      return -1;
+    if (r->p >= r->end || *r->p != ')') {
+      r->err = "unmatched (";
+      return -1;
+    }
+    r->p++;
+    return 0;
+  case '^':
+    return re_frag(r, N_BOL, f);
+  case '$':
+    return re_frag(r, N_EOL, f);
+  }
+  if (re_frag(r, N_SET, f) < 0)
+    return -1;
+  uint32_t *set = r->nodes[f->start].set;
+  if (c == '.') {
+    memset(set, 0xff, 8 * sizeof(*set));
+    set[0] &= ~(1u << '\n');
+  } else if (c == '[') {
+    return re_bracket(r, set);
+  } else if (c == '\\') {
+    if (r->p >= r->end) {
+      r->err = "trailing backslash";
+      return -1;
+    }
+    re_escape(set, (unsigned char)*r->p++);
+  } else {
+    set_add(set, c);
+  }
+  return 0;
+}
+
+static int re_number(Regex *r, const char **pp) {
+  const char *p = *pp;
+  int n = 0;
+  while (p < r->end && *p >= '0' && *p <= '9') {
+    n = n * 10 + (*p++ - '0');
+    if (n > RE_MAX_REPEAT)
+      n = RE_MAX_REPEAT + 1;
+  }
+  *pp = p;
+  return n;
+}
+
+// {m}, {m,} or {m,n}; a brace that does not start one is literal.
+static int re_bounds(Regex *r, int *lo, int *hi) {
+  const char *p = r->p + 1;
+  if (p >= r->end || *p < '0' || *p > '9')
+    return 0;
+  int m = re_number(r, &p), n = m;
+  if (p < r->end && *p == ',') {
+    p++;
+    n = p < r->end && *p >= '0' && *p <= '9' ? re_number(r, &p) : -1;
+  }
+  if (p >= r->end || *p != '}')
+    return 0;
+  if (m > RE_MAX_REPEAT || n > RE_MAX_REPEAT || (n >= 0 && n < m)) {
+    r->err = "invalid repetition count";
+    return -1;
+  }
+  r->p = p + 1;
+  *lo = m;
+  *hi = n;
+  return 1;
+}
+
+static int re_piece(Regex *r, Frag *f, int depth) {
+  const char *atom = r->p;
+  if (re_atom(r, f, depth) < 0)
+    return -1;
+  int counted = 0;
+  while (r->p < r->end) {
+    char op = *r->p;
+    if (op == '*' || op == '+' || op == '?') {
+      r->p++;
+      if (re_repeat(r, f, op) < 0)
+        return -1;
+      counted = 1;
+      continue;
+    }
+    int lo, hi, k;
+    if (op != '{' || (k = re_bounds(r, &lo, &hi)) == 0)
+      break;
+    if (k < 0)
+      return -1;
+    if (counted) {
+      r->err = "repetition of a repetition";
+      return -1;
+    }
+    counted = 1;
+    // Expand into copies of the atom: lo required ones, then either a
+    // starred one or hi - lo optional ones.
+    const char *resume = r->p;
+    Frag sum, copy;
+    if (re_empty(r, &sum) < 0)
+      return -1;
+    for (int i = 0; i < (hi < 0 ? lo + 1 : hi); i++) {
+      if (i == 0) {
+        copy = *f;
+      } else {
+        r->p = atom;
+        if (re_atom(r, &copy, depth) < 0)
+          return -1;
+      }
+      if (i >= lo && re_repeat(r, &copy, hi < 0 ? '*' : '?') < 0)
+        return -1;
+      re_cat(r, &sum, &copy);
+    }
+    r->p = resume;
+    *f = sum;
+  }
+  return 0;
+}
+
+static int re_alternation(Regex *r, Frag *f, int depth) {
+  if (depth > 256) {
+    r->err = "nesting too deep";
+    return -1;
+  }
+  Frag branch;
+  int have = 0;
+  for (;;) {
+    if (re_empty(r, &branch) < 0)
+      return -1;
+    while (r->p < r->end && *r->p != '|' && !(*r->p == ')' && depth > 0)) {
+      Frag piece;
+      if (re_piece(r, &piece, depth) < 0)
+        return -1;
+      re_cat(r, &branch, &piece);
+    }
+    if (!have)
+      *f = branch;
+    else if (re_alt(r, f, &branch) < 0)
+      return -1;
+    have = 1;
+    if (r->p >= r->end || *r->p != '|')
+      return 0;
+    r->p++;
+  }
+}
+
+// Every pattern becomes one branch of a top level alternation.
+static int re_compile(Regex *r, char **pats, size_t npats) {
+  Frag all, f;
+  size_t i;
+  memset(r, 0, sizeof(*r));
+  for (i = 0; i < npats; i++) {
+    r->p = pats[i];
+    r->end = pats[i] + strlen(pats[i]);
+    if (re_alternation(r, &f, 0) < 0)
+      goto bad;
+    if (r->p < r->end) {
+      r->err = "unmatched )";
+      goto bad;
+    }
+    if (i == 0)
+      all = f;
+    else if (re_alt(r, &all, &f) < 0)
+      goto bad;
+  }
+  if (npats == 0 && re_frag(r, N_SET, &all) < 0) // matches nothing
+    goto bad;
+  if ((r->match = re_node(r, N_MATCH)) < 0)
+    goto bad;
+  r->nodes[all.end].out = r->match;
+  r->start = all.start;
+  return 0;
+bad:
+  fprintf(stderr, "mygrep: %s: %s\n", i < npats ? pats[i] : "",
+          r->err ? r->err : "invalid pattern");
+  return -1;
+}
+
+// Epsilon closure of seed into r->work, sorted. BOL assertions pass only
+// at the start of a line and EOL assertions only at its end; a pending
+// EOL node is kept in the set so the end-of-line check can resume it.
+static size_t re_closure(Regex *r, size_t nseed, int bol, int eol) {
+  size_t n = 0, sp = 0;
+  if (++r->gen == 0) {
+    memset(r->mark, 0, r->nnodes * sizeof(*r->mark));
+    r->gen = 1;
+  }
+  for (size_t i = 0; i < nseed; i++)
+    r->stack[sp++] = r->seed[i];
+  while (sp) {
+    int s = r->stack[--sp];
+    if (s < 0 || r->mark[s] == r->gen)
+      continue;
+    r->mark[s] = r->gen;
+    const Node *nd = &r->nodes[s];
+    switch (nd->type) {
+    case N_SPLIT:
+      r->stack[sp++] = nd->out1;
+      r->stack[sp++] = nd->out;
+      break;
+    case N_EPS:
+      r->stack[sp++] = nd->out;
+      break;
+    case N_BOL:
+      if (bol)
+        r->stack[sp++] = nd->out;
+      break;
+    case N_EOL:
+      if (eol)
+        r->stack[sp++] = nd->out;
+      else
+        r->work[n++] = s;
+      break;
+    default:
+      r->work[n++] = s;
+    }
+  }
+  for (size_t i = 1; i < n; i++) { // sets are small; insertion sort
+    int v = r->work[i];
+    size_t j = i;
+    for (; j > 0 && r->work[j - 1] > v; j--)
+      r->work[j] = r->work[j - 1];
+    r->work[j] = v;
+  }
+  return n;
+}
+
+static int re_contains(const int *set, size_t n, int node) {
+  for (size_t i = 0; i < n; i++)
+    if (set[i] == node)
+      return 1;
+  return 0;
+}
+
+static void dfa_flush(Regex *r) {
+  for (size_t i = 0; i < r->nst; i++)
+    free(r->st[i].set);
+  r->nst = 0;
+  memset(r->hash, 0, r->hcap * sizeof(*r->hash));
+}
+
+// State for the set in r->work[0..n), created if it is not cached yet.
+// Returns -1 when the cache is full or memory runs out.
+static int dfa_state(Regex *r, size_t n, int bol) {
+  uint64_t h = 1469598103934665603ull;
+  for (size_t i = 0; i < n; i++)
+    h = (h ^ (uint64_t)r->work[i]) * 1099511628211ull;
+  size_t slot = h & (r->hcap - 1);
+  for (; r->hash[slot]; slot = (slot + 1) & (r->hcap - 1)) {
+    Dstate *d = &r->st[r->hash[slot] - 1];
+    if (d->n == n && memcmp(d->set, r->work, n * sizeof(int)) == 0)
+      return r->hash[slot] - 1;
+  }
+  if (r->nst == DFA_MAX_STATES)
+    return -1;
+  Dstate *d = &r->st[r->nst];
+  if (!(d->set = malloc((n ? n : 1) * sizeof(int))))
+    return -1;
+  memcpy(d->set, r->work, n * sizeof(int));
+  d->n = n;
+  memset(d->trans, 0xff, sizeof(d->trans));
+  d->accept = re_contains(d->set, n, r->match);
+
+  // Would the line ending here complete a match?
+  memcpy(r->seed, d->set, n * sizeof(int));
+  d->accept_eol = re_contains(r->work, re_closure(r, n, bol, 1), r->match);
+  r->hash[slot] = (int)r->nst + 1;
+  return (int)r->nst++;
+}
+
+static int dfa_init(Regex *r) {
+  r->seed[0] = r->start;
+  size_t n = re_closure(r, 1, 1, 0);
+  return r->init = dfa_state(r, n, 1);
+}
+
+// Transition of state s on byte c. The start node is re-seeded after
+// every byte, which makes the search unanchored.
+static int dfa_step(Regex *r, int s, unsigned char c) {
+  const Dstate *d = &r->st[s];
+  size_t nseed = 0;
+  for (size_t i = 0; i < d->n; i++) {
+    const Node *nd = &r->nodes[d->set[i]];
+    if (nd->type == N_SET && set_has(nd->set, c))
+      r->seed[nseed++] = nd->out;
+  }
+  r->seed[nseed++] = r->start;
+  size_t n = re_closure(r, nseed, 0, 0);
+  int t = dfa_state(r, n, 0);
+  if (t >= 0) {
+    r->st[s].trans[c] = t;
+    return t;
+  }
+  // Cache full: start over with just the start state and this one. The
+  // closure is still in r->work, but dfa_init overwrites it.
+  int *keep = malloc((n ? n : 1) * sizeof(int));
+  if (!keep)
+    return -1;
+  memcpy(keep, r->work, n * sizeof(int));
+  dfa_flush(r);
+  if (dfa_init(r) < 0) {
+    free(keep);
+    return -1;
+  }
+  memcpy(r->work, keep, n * sizeof(int));
+  free(keep);
+  return dfa_state(r, n, 0);
+}
+
+static int re_prepare(Regex *r) {
+  size_t n = r->nnodes + 1;
+  r->nst = 0;
+  r->gen = 0;
+  r->seed = malloc(n * sizeof(int));
+  r->work = malloc(n * sizeof(int));
+  r->stack = malloc(2 * n * sizeof(int));
+  r->mark = calloc(n, sizeof(unsigned));
+  r->st = malloc(DFA_MAX_STATES * sizeof(Dstate));
+  r->hcap = 2 * DFA_MAX_STATES;
+  r->hash = calloc(r->hcap, sizeof(int));
+  if (!r->seed || !r->work || !r->stack || !r->mark || !r->st || !r->hash)
+    return -1;
+  return dfa_init(r) < 0 ? -1 : 0;
+}
+
+// Frees the DFA cache and work space of a regex prepared by re_prepare.
+static void re_release(Regex *r) {
+  dfa_flush(r);
+  free(r->st);
+  free(r->hash);
+  free(r->seed);
+  free(r->work);
+  free(r->stack);
+  free(r->mark);
+}
+
+// The compiled pattern set. next() is called with p at the start of a
+// line and returns a pointer into the first matching line in [p, end),
+// or NULL.
+typedef struct Matcher Matcher;
+struct Matcher {
+  const char *(*next)(Matcher *m, const char *p, const char *end);
+  int match_all; // some pattern matches every line
+  const char *pat;
+  size_t plen;
+  Aho aho;
+  Regex re;
+};
+
+static const char *next_fixed(Matcher *m, const char *p, const char *end) {
+  const char *hit = find(p, (size_t)(end - p), m->pat, m->plen);
+  return hit ? hit + m->plen - 1 : NULL;
+}
+
+static const char *next_aho(Matcher *m, const char *p, const char *end) {
+  const uint32_t *delta = m->aho.delta;
+  const uint8_t *out = m->aho.out;
+  uint32_t s = 0;
+  for (; p < end; p++) {
+    s = delta[s * 256 + (unsigned char)*p];
+    if (out[s])
+      return p;
+  }
+  return NULL;
+}
+
+static const char *next_regex(Matcher *m, const char *p, const char *end) {
+  Regex *r = &m->re;
+  const char *bol = p;
+  int s = r->init;
+  for (; p < end; p++) {
+    unsigned char c = (unsigned char)*p;
+    if (c == '\n') {
+      if (r->st[s].accept_eol)
+        return p;
+      s = r->init;
+      bol = p + 1;
+      continue;
+    }
+    int t = r->st[s].trans[c];
+    if (t < 0 && (t = dfa_step(r, s, c)) < 0) {
+      fprintf(stderr, "mygrep: out of memory\n");
+      exit(2);
+    }
+    s = t;
+    if (r->st[s].accept)
+      return p;
+  }
+  // Unterminated last line.
+  if (bol < end && r->st[s].accept_eol)
+    return end - 1;
+  return NULL;
+}
+
+static int is_literal(const char *pat) {
+  return pat[strcspn(pat, "\\.[]()*+?{}|^$")] == '\0';
+}
+
+// Regex mode falls back to the fixed string engines when no pattern uses
+// a metacharacter.
+static int matcher_init(Matcher *m, char **pats, size_t npats, int regex) {
+  memset(m, 0, sizeof(*m));
+  if (regex) {
+    regex = 0;
+    for (size_t i = 0; i < npats && !regex; i++)
+      regex = !is_literal(pats[i]);
+    if (regex) {
+      if (re_compile(&m->re, pats, npats) < 0)
+        return -1;
+      if (re_prepare(&m->re) < 0) {
+        fprintf(stderr, "mygrep: out of memory\n");
+        return -1;
+      }
+      m->match_all = m->re.st[m->re.init].accept;
+      m->next = next_regex;
+      return 0;
+    }
+  }
+  for (size_t i = 0; i < npats; i++)
+    if (pats[i][0] == '\0')
+      m->match_all = 1;
+  if (npats == 1) {
+    m->pat = pats[0];
+    m->plen = strlen(pats[0]);
+    m->next = next_fixed;
+    return 0;
+  }
+  if (aho_build(&m->aho, pats, npats) < 0) {
+    fprintf(stderr, "mygrep: out of memory\n");
+    return -1;
+  }
+  m->next = next_aho;
+  return 0;
+}
+
+static Matcher matcher;
+
+static char **pats;
+static size_t npats, pats_cap;
+
+// Patterns are newline separated, as in grep. A trailing newline in a
+// pattern file ends the last pattern rather than adding an empty one.
+static int add_patterns(const char *s, size_t len, int from_file) {
+  const char *end = s + len;
+  if (from_file && len > 0 && end[-1] == '\n')
+    end--;
+  else if (from_file && len == 0)
+    return 0;
+  for (;;) {
+    const char *nl = memchr(s, '\n', (size_t)(end - s));
+    const char *e = nl ? nl : end;
+    if (npats == pats_cap) {
+      size_t cap = pats_cap ? pats_cap * 2 : 16;
+      char **p = realloc(pats, cap * sizeof(*p));
+      if (!p)
+        return -1;
+      pats = p;
+      pats_cap = cap;
+    }
+    if (!(pats[npats] = strndup(s, (size_t)(e - s))))
+      return -1;
+    npats++;
+    if (!nl)
+      return 0;
+    s = nl + 1;
+  }
+}
+
+static int read_pattern_file(const char *path) {
+  int fd = strcmp(path, "-") == 0 ? STDIN_FILENO : open(path, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "mygrep: cannot open %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+  char *buf = NULL;
+  size_t len = 0, cap = 0;
+  ssize_t n;
+  do {
+    if (len == cap) {
+      cap = cap ? cap * 2 : 65536;
+      char *p = realloc(buf, cap);
+      if (!p) {
+        n = -1;
+        break;
+      }
+      buf = p;
+    }
+    n = read(fd, buf + len, cap - len);
+    if (n > 0)
+      len += (size_t)n;
+  } while (n > 0 || (n < 0 && errno == EINTR));
   int ret = 0;
+  if (n < 0) {
+    fprintf(stderr, "mygrep: read error on %s: %s\n", path, strerror(errno));
+    ret = -1;
+  } else if (add_patterns(buf ? buf : "", len, 1) < 0) {
+    fprintf(stderr, "mygrep: out of memory\n");
+    ret = -1;
+  }
+  free(buf);
+  if (fd != STDIN_FILENO)
+    close(fd);
+  return ret;
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "Usage: %s [-Eclq] [-m NUM] [-j N] [--use-index DIR] "
+          "[-e PATTERN]... [-f FILE]... [PATTERN] [FILE...]\n"
+          "       %s --index DIR\n",
+          prog, prog);
+}
+
+// -c, -l and -q replace the matching lines with a count, the file name or
+// just the exit status; -m stops after NUM matching lines. Only as many
+// lines as the answer needs are searched for, and the rest of the input
+// is never read.
+static struct {
+  int count, list, quiet;
+  long max;  // -m, or -1
+  int names; // prefix counts with the file name
+} mode = {.max = -1};
+
+static int found; // some file had a matching line
+
+// Set by -q on the first match, from any thread; searches poll it and
+// wind down, and main() returns the answer.
+static int quit;
+
+static int quitting(void) {
+  return __atomic_load_n(&quit, __ATOMIC_RELAXED);
+}
+
+static int print_lines(void) {
+  return !mode.count && !mode.list && !mode.quiet;
+}
+
+static long line_limit(void) {
+  if (mode.quiet || mode.list)
+    return 1;
+  return mode.max < 0 ? LONG_MAX : mode.max;
+}
+
+// Output of one file or chunk while searching in parallel, collected
+// until it is that piece's turn to be written. A NULL Out means stdout
+// and stderr directly.
+typedef struct {
+  char *buf;
+  size_t len, cap;
+  long hits; // matching lines found
+  int status;
+  char msg[512]; // error to print after buf
+} Out;
 
-  while ((n = getline(&line, &cap, fp)) != -1) {
-    if (strstr(line, pattern) != NULL) {
-      fputs(line, stdout);
+static void emit(Out *o, const char *p, size_t n) {
+  if (!o) {
+    fwrite_unlocked(p, 1, n, stdout);
+    return;
+  }
+  if (o->cap - o->len < n) {
+    size_t cap = o->cap ? o->cap : 65536;
+    while (cap - o->len < n)
+      cap *= 2;
+    char *buf = realloc(o->buf, cap);
+    if (!buf) {
+      o->status = 1;
+      snprintf(o->msg, sizeof(o->msg), "mygrep: out of memory\n");
+      return;
     }
+    o->buf = buf;
+    o->cap = cap;
   }
+  memcpy(o->buf + o->len, p, n);
+  o->len += n;
+}
 
-  if (ferror(fp)) {
-    fprintf(stderr, "mygrep: read error on %s: %s\n", name ? name : "stdin",
-            strerror(errno));
+__attribute__((format(printf, 2, 3))) static void report(Out *o,
+                                                         const char *fmt,
+                                                         ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  if (o)
+    vsnprintf(o->msg, sizeof(o->msg), fmt, ap);
+  else
+    vfprintf(stderr, fmt, ap);
+  va_end(ap);
+}
+
+// Searches [p, end), which holds whole lines, as one piece; line
+// boundaries are only looked up around a hit, and the search resumes
+// after that line. Stops after budget matching lines and returns how
+// many were found, except when printing every line of an unlimited
+// match_all search, where it only tells whether there was any.
+static long grep_block(Matcher *m, const char *p, const char *end,
+                       long budget, Out *o) {
+  int print = print_lines();
+  long hits = 0;
+  if (m->match_all && print && budget == LONG_MAX) {
+    emit(o, p, (size_t)(end - p));
+    return p < end;
+  }
+  while (p < end && hits < budget) {
+    const char *hit = m->match_all ? p : m->next(m, p, end);
+    if (!hit)
+      break;
+    const char *bol = memrchr(p, '\n', (size_t)(hit - p));
+    bol = bol ? bol + 1 : p;
+    const char *eol = memchr(hit, '\n', (size_t)(end - hit));
+    const char *next = eol ? eol + 1 : end;
+    if (print)
+      emit(o, bol, (size_t)(next - bol));
+    hits++;
+    p = next;
+  }
+  if (hits && mode.quiet) // the answer is known, whatever else is pending
+    __atomic_store_n(&quit, 1, __ATOMIC_RELAXED);
+  return hits;
+}
+
+// Regular files are mapped, other inputs arrive in blocks of whole lines.
+static int grep_stream(Matcher *m, int fd, const char *name, Out *o,
+                       long *hits) {
+  long limit = line_limit();
+  Input in;
+  const char *block;
+  ssize_t n = 0;
+  int ret = 0;
+
+  *hits = 0;
+  input_open(&in, fd);
+  while (*hits < limit && !quitting() && (n = input_lines(&in, &block)) > 0)
+    *hits += grep_block(m, block, block + n, limit - *hits, o);
+
+  if (n < 0) {
+    report(o, "mygrep: read error on %s: %s\n", name ? name : "stdin",
+           strerror(errno));
     ret = 1;
   }
-  free(line);
+  input_close(&in);
   return ret;
 }
 
-int main(int argc, char **argv) {
-  if (argc < 2) {
-    usage(argv[0]);
-    return 2;
+// The -c and -l line for a file, once its search is over.
+static void summarize(const char *name, long hits, Out *o) {
+  char line[64];
+  if (!name)
+    name = "(standard input)";
+  if (mode.quiet)
+    return;
+  if (mode.list) {
+    if (hits) {
+      emit(o, name, strlen(name));
+      emit(o, "\n", 1);
+    }
+  } else if (mode.count) {
+    if (mode.names) {
+      emit(o, name, strlen(name));
+      emit(o, ":", 1);
+    }
+    emit(o, line, (size_t)snprintf(line, sizeof(line), "%ld\n", hits));
   }
-  const char *pattern = argv[1];
+}
 
-  int status = 0;
+// Parallel search with -j. Every worker owns a queue that starts with
+// every Nth file; a worker that runs dry steals from the others. A
+// regular file of at least two PAR_CHUNKs is mapped and cut into chunks
+// that end on a newline, and the chunks are queued in front of the
+// owner's remaining files so idle workers pick them up first. The main
+// thread writes each file's pieces in command line order as they
+// complete, so the output is the same as the serial one.
+#define PAR_CHUNK (4 * 1024 * 1024)
+#define MAX_JOBS 256
+
+typedef struct {
+  int file;
+  int piece; // -1: open the file and decide how to split it
+} Task;
+
+typedef struct {
+  pthread_mutex_t mu;
+  Task *q; // ring buffer
+  size_t head, n, cap;
+} Deque;
+
+typedef struct {
+  const char *name;
+  int fd;
+  char *map;
+  size_t size;
+  size_t *cut; // piece i is [cut[i], cut[i + 1]) of the mapping
+  Out *pieces;
+  int npieces;
+  int pending; // pieces not searched yet
+  int done;
+  int enough; // -l: a piece matched, the others can be skipped
+  int failed; // could not be opened, so it gets no -c or -l line
+} Job;
+
+typedef struct {
+  int id;
+  Matcher m; // private lazy DFA cache in regex mode
+} Worker;
+
+static struct {
+  Job *jobs;
+  int njobs;
+  Deque *dq;
+  int nworkers;
+  pthread_mutex_t mu;
+  pthread_cond_t work_cv, done_cv;
+  long outstanding;     // tasks queued or running
+  unsigned long pushes; // bumped on every push, against lost wakeups
+} pool;
+
+static int dq_push_front(Deque *d, Task t) {
+  pthread_mutex_lock(&d->mu);
+  if (d->n == d->cap) {
+    size_t cap = d->cap ? d->cap * 2 : 64;
+    Task *q = malloc(cap * sizeof(*q));
+    if (!q) {
+      pthread_mutex_unlock(&d->mu);
+      return -1;
+    }
+    for (size_t i = 0; i < d->n; i++)
+      q[i] = d->q[(d->head + i) % d->cap];
+    free(d->q);
+    d->q = q;
+    d->head = 0;
+    d->cap = cap;
+  }
+  d->head = (d->head + d->cap - 1) % d->cap;
+  d->q[d->head] = t;
+  d->n++;
+  pthread_mutex_unlock(&d->mu);
+  return 0;
+}
+
+static int dq_pop(Deque *d, Task *t) {
+  int got = 0;
+  pthread_mutex_lock(&d->mu);
+  if (d->n) {
+    *t = d->q[d->head];
+    d->head = (d->head + 1) % d->cap;
+    d->n--;
+    got = 1;
+  }
+  pthread_mutex_unlock(&d->mu);
+  return got;
+}
+
+static int take_task(int self, Task *t) {
+  for (int i = 0; i < pool.nworkers; i++)
+    if (dq_pop(&pool.dq[(self + i) % pool.nworkers], t))
+      return 1;
+  return 0;
+}
+
+static int push_task(int self, Task t) {
+  pthread_mutex_lock(&pool.mu);
+  pool.outstanding++;
+  pthread_mutex_unlock(&pool.mu);
+  if (dq_push_front(&pool.dq[self], t) < 0) {
+    pthread_mutex_lock(&pool.mu);
+    pool.outstanding--;
+    pthread_mutex_unlock(&pool.mu);
+    return -1;
+  }
+  pthread_mutex_lock(&pool.mu);
+  pool.pushes++;
+  pthread_cond_broadcast(&pool.work_cv);
+  pthread_mutex_unlock(&pool.mu);
+  return 0;
+}
+
+static void piece_done(Job *j) {
+  pthread_mutex_lock(&pool.mu);
+  int last = --j->pending == 0;
+  if (quitting()) // the writer may be waiting on stdin
+    pthread_cond_broadcast(&pool.done_cv);
+  pthread_mutex_unlock(&pool.mu);
+  if (!last)
+    return;
+  if (j->map)
+    munmap(j->map, j->size);
+  if (j->fd >= 0)
+    close(j->fd);
+  pthread_mutex_lock(&pool.mu);
+  j->done = 1;
+  pthread_cond_broadcast(&pool.done_cv);
+  pthread_mutex_unlock(&pool.mu);
+}
 
-  if (argc == 2) {
-    status |= grep_stream(stdin, NULL, pattern);
+// Each chunk is searched up to the full line limit, since the chunks
+// before it may not reach it; the writer trims the surplus.
+static void search_piece(Worker *w, Job *j, int i) {
+  Out *o = &j->pieces[i];
+  if (!__atomic_load_n(&j->enough, __ATOMIC_RELAXED) && !quitting()) {
+    o->hits = grep_block(&w->m, j->map + j->cut[i], j->map + j->cut[i + 1],
+                         line_limit(), o);
+    if (o->hits && mode.list)
+      __atomic_store_n(&j->enough, 1, __ATOMIC_RELAXED);
+  }
+  piece_done(j);
+}
+
+// Splits a mapped file at the first newline after every PAR_CHUNK
+// boundary. Returns -1 if it is not worth it or memory runs out.
+static int split_job(Job *j, const struct stat *st) {
+  if (!S_ISREG(st->st_mode) || st->st_size < 2 * (off_t)PAR_CHUNK)
+    return -1;
+  j->size = (size_t)st->st_size;
+  j->map = mmap(NULL, j->size, PROT_READ, MAP_PRIVATE, j->fd, 0);
+  if (j->map == MAP_FAILED || input_compressed(j->map, j->size)) {
+    if (j->map != MAP_FAILED) // decoded as a stream instead
+      munmap(j->map, j->size);
+    j->map = NULL;
+    return -1;
+  }
+  madvise(j->map, j->size, MADV_WILLNEED);
+  int n = (int)((j->size + PAR_CHUNK - 1) / PAR_CHUNK);
+  Out *pieces = calloc((size_t)n, sizeof(*pieces));
+  j->cut = malloc(((size_t)n + 1) * sizeof(*j->cut));
+  if (!pieces || !j->cut) {
+    free(pieces);
+    munmap(j->map, j->size);
+    j->map = NULL;
+    return -1;
+  }
+  free(j->pieces);
+  j->pieces = pieces;
+  j->cut[0] = 0;
+  for (int i = 1; i < n; i++) {
+    size_t at = (size_t)i * PAR_CHUNK;
+    if (at < j->cut[i - 1])
+      at = j->cut[i - 1];
+    const char *nl = memchr(j->map + at, '\n', j->size - at);
+    j->cut[i] = nl ? (size_t)(nl + 1 - j->map) : j->size;
+  }
+  j->cut[n] = j->size;
+  j->npieces = n;
+  return 0;
+}
+
+static void run_file(Worker *w, Job *j) {
+  j->fd = -1;
+  if (quitting()) {
+    piece_done(j);
+    return;
+  }
+  if (strcmp(j->name, "-") == 0) {
+    j->pieces[0].status = grep_stream(&w->m, STDIN_FILENO, NULL, j->pieces,
+                                      &j->pieces[0].hits);
+    piece_done(j);
+    return;
+  }
+  j->fd = open(j->name, O_RDONLY);
+  if (j->fd < 0) {
+    report(j->pieces, "mygrep: cannot open %s: %s\n", j->name,
+           strerror(errno));
+    j->pieces[0].status = 1;
+    j->failed = 1;
+    piece_done(j);
+    return;
+  }
+  struct stat st;
+  if (fstat(j->fd, &st) == 0 && split_job(j, &st) == 0) {
+    pthread_mutex_lock(&pool.mu);
+    j->pending = j->npieces;
+    pthread_mutex_unlock(&pool.mu);
+    for (int i = j->npieces - 1; i > 0; i--)
+      if (push_task(w->id, (Task){(int)(j - pool.jobs), i}) < 0)
+        search_piece(w, j, i);
+    search_piece(w, j, 0);
+    return;
+  }
+  j->pieces[0].status =
+      grep_stream(&w->m, j->fd, j->name, j->pieces, &j->pieces[0].hits);
+  piece_done(j);
+}
+
+static void *worker_main(void *arg) {
+  Worker *w = arg;
+  for (;;) {
+    pthread_mutex_lock(&pool.mu);
+    unsigned long seen = pool.pushes;
+    pthread_mutex_unlock(&pool.mu);
+    Task t;
+    if (take_task(w->id, &t)) {
+      Job *j = &pool.jobs[t.file];
+      if (t.piece < 0)
+        run_file(w, j);
+      else
+        search_piece(w, j, t.piece);
+      pthread_mutex_lock(&pool.mu);
+      if (--pool.outstanding == 0)
+        pthread_cond_broadcast(&pool.work_cv);
+      pthread_mutex_unlock(&pool.mu);
+      continue;
+    }
+    // Nothing to take, but a running file may still be split.
+    pthread_mutex_lock(&pool.mu);
+    while (pool.outstanding > 0 && pool.pushes == seen)
+      pthread_cond_wait(&pool.work_cv, &pool.mu);
+    int finished = pool.outstanding == 0;
+    pthread_mutex_unlock(&pool.mu);
+    if (finished)
+      return NULL;
+  }
+}
+
+static int matcher_clone(Matcher *dst, const Matcher *src) {
+  *dst = *src;
+  if (src->next != next_regex)
+    return 0;
+  return re_prepare(&dst->re);
+}
+
+static int grep_parallel(char **names, int n, int nworkers) {
+  Worker workers[MAX_JOBS];
+  pthread_t th[MAX_JOBS];
+  int started = 0, status = 0, stdin_job = 0;
+
+  pool.jobs = calloc((size_t)n, sizeof(*pool.jobs));
+  pool.dq = calloc((size_t)nworkers, sizeof(*pool.dq));
+  if (!pool.jobs || !pool.dq) {
+    fprintf(stderr, "mygrep: out of memory\n");
+    return 1;
+  }
+  pool.njobs = n;
+  pool.nworkers = nworkers;
+  pool.outstanding = n;
+  pthread_mutex_init(&pool.mu, NULL);
+  pthread_cond_init(&pool.work_cv, NULL);
+  pthread_cond_init(&pool.done_cv, NULL);
+  for (int w = 0; w < nworkers; w++) {
+    pthread_mutex_init(&pool.dq[w].mu, NULL);
+    workers[w].id = w;
+    if (matcher_clone(&workers[w].m, &matcher) < 0) {
+      fprintf(stderr, "mygrep: out of memory\n");
+      return 1;
+    }
+  }
+  // Queued back to front, so worker w starts with file w.
+  for (int i = n - 1; i >= 0; i--) {
+    Job *j = &pool.jobs[i];
+    j->name = names[i];
+    j->pending = j->npieces = 1;
+    stdin_job |= strcmp(j->name, "-") == 0;
+    j->pieces = calloc(1, sizeof(*j->pieces));
+    if (!j->pieces ||
+        dq_push_front(&pool.dq[i % nworkers], (Task){i, -1}) < 0) {
+      fprintf(stderr, "mygrep: out of memory\n");
+      return 1;
+    }
+  }
+  for (int w = 0; w < nworkers; w++)
+    if (pthread_create(&th[started], NULL, worker_main, &workers[w]) == 0)
+      started++;
+  if (started == 0) // no threads: steal everything from this one
+    worker_main(&workers[0]);
+
+  for (int i = 0; i < n; i++) {
+    Job *j = &pool.jobs[i];
+    pthread_mutex_lock(&pool.mu);
+    while (!j->done && !(stdin_job && quitting()))
+      pthread_cond_wait(&pool.done_cv, &pool.mu);
+    int done = j->done;
+    pthread_mutex_unlock(&pool.mu);
+    if (!done) // -q has its answer, but stdin may never end
+      return 0;
+    long hits = 0, limit = line_limit();
+    for (int k = 0; k < j->npieces; k++) {
+      Out *o = &j->pieces[k];
+      size_t len = o->len;
+      if (o->hits > limit - hits) { // -m reached in an earlier piece
+        const char *p = o->buf;
+        for (long l = 0; len && l < limit - hits; l++)
+          p = memchr(p, '\n', (size_t)(o->buf + o->len - p)) + 1;
+        len = (size_t)(p - o->buf);
+        o->hits = limit - hits;
+      }
+      hits += o->hits;
+      if (len)
+        fwrite_unlocked(o->buf, 1, len, stdout);
+      if (o->msg[0]) {
+        fflush(stdout);
+        fputs(o->msg, stderr);
+      }
+      status |= o->status;
+      free(o->buf);
+    }
+    found |= hits > 0;
+    if (!j->failed)
+      summarize(strcmp(j->name, "-") == 0 ? NULL : j->name, hits, NULL);
+    free(j->pieces);
+    free(j->cut);
+  }
+  for (int t = 0; t < started; t++)
+    pthread_join(th[t], NULL);
+  for (int w = 0; w < nworkers; w++) {
+    if (workers[w].m.next == next_regex)
+      re_release(&workers[w].m.re);
+    free(pool.dq[w].q);
+  }
+  free(pool.dq);
+  free(pool.jobs);
+  return status;
+}
+
+// Serial search of one command line operand, "-" being stdin.
+static int grep_path(const char *path) {
+  long hits;
+  int status;
+  if (strcmp(path, "-") == 0) {
+    status = grep_stream(&matcher, STDIN_FILENO, NULL, NULL, &hits);
+    path = NULL;
   } else {
-    for (int i = 2; i < argc; i++) {
-      if (strcmp(argv[i], "-") == 0) {
-        status |= grep_stream(stdin, NULL, pattern);
-        clearerr(stdin);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+      fprintf(stderr, "mygrep: cannot open %s: %s\n", path, strerror(errno));
+      return 1;
+    }
+    status = grep_stream(&matcher, fd, path, NULL, &hits);
+    close(fd);
+  }
+  found |= hits > 0;
+  summarize(path, hits, NULL);
+  return status;
+}
+
+// Trigram index for --index and --use-index. Every regular file below a
+// directory is cut into blocks of about IDX_BLOCK bytes that end on a
+// newline, and for every trigram that occurs within a line the index
+// lists the blocks holding it. A query derives trigrams that any match
+// must contain, and only the blocks that hold all of them are read and
+// searched with the normal matcher. The file is laid out as
+//
+//   IdxHeader | IdxFile[nfiles] | block start offsets (u64)[nblocks] |
+//   IdxTri[ntri] | file names | posting lists
+//
+// with files sorted by their real path, trigrams in ascending order and
+// each posting list a run of LEB128 deltas between block numbers.
+// Rebuilding keeps the postings of files whose size and mtime are
+// unchanged and only reads the others.
+#define IDX_NAME ".mygrep-index"
+#define IDX_MAGIC "MGI1"
+#define IDX_BLOCK (64 * 1024)
+
+typedef struct {
+  char magic[4];
+  uint32_t nfiles;
+  uint32_t ntri;
+  uint32_t reserved;
+  uint64_t nblocks;
+  uint64_t names_len;
+  uint64_t post_len;
+} IdxHeader;
+
+typedef struct {
+  uint64_t size;
+  int64_t mtime_sec, mtime_nsec;
+  uint64_t name; // offset into the name table
+  uint64_t first_block;
+  uint64_t nblocks;
+} IdxFile;
+
+typedef struct {
+  uint32_t tri;
+  uint32_t count; // blocks in the posting list
+  uint64_t off;   // into the posting area
+} IdxTri;
+
+typedef struct {
+  char *map;
+  size_t len;
+  const IdxHeader *h;
+  const IdxFile *files;
+  const uint64_t *blocks;
+  const IdxTri *tris;
+  const char *names;
+  const unsigned char *post;
+} Index;
+
+static char *idx_path(const char *dir, const char *suffix) {
+  size_t len = strlen(dir) + sizeof(IDX_NAME) + strlen(suffix) + 1;
+  char *path = malloc(len);
+  if (path)
+    snprintf(path, len, "%s/%s%s", dir, IDX_NAME, suffix);
+  return path;
+}
+
+static int idx_load(const char *path, Index *ix) {
+  memset(ix, 0, sizeof(*ix));
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return -1;
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    close(fd);
+    return -1;
+  }
+  ix->len = (size_t)st.st_size;
+  ix->map = ix->len >= sizeof(IdxHeader)
+                ? mmap(NULL, ix->len, PROT_READ, MAP_PRIVATE, fd, 0)
+                : MAP_FAILED;
+  close(fd);
+  if (ix->map == MAP_FAILED) {
+    ix->map = NULL;
+    errno = EINVAL;
+    return -1;
+  }
+  // Every term is below 2^40 or the file size, so the sum cannot wrap.
+  const IdxHeader *h = ix->h = (const IdxHeader *)ix->map;
+  if (memcmp(h->magic, IDX_MAGIC, 4) != 0 || h->nblocks > UINT32_MAX ||
+      h->names_len > ix->len || h->post_len > ix->len ||
+      sizeof(*h) + h->nfiles * sizeof(IdxFile) +
+              h->nblocks * sizeof(uint64_t) + h->ntri * sizeof(IdxTri) +
+              h->names_len + h->post_len !=
+          ix->len)
+    goto bad;
+  ix->files = (const IdxFile *)(h + 1);
+  ix->blocks = (const uint64_t *)(ix->files + h->nfiles);
+  ix->tris = (const IdxTri *)(ix->blocks + h->nblocks);
+  ix->names = (const char *)(ix->tris + h->ntri);
+  ix->post = (const unsigned char *)ix->names + h->names_len;
+
+  // Names must be terminated inside the name table, block ranges inside
+  // the block table with offsets ascending within the file, and posting
+  // lists inside the posting area. idx_postings() checks the block
+  // numbers as it decodes them.
+  if (h->nfiles && (h->names_len == 0 || ix->names[h->names_len - 1]))
+    goto bad;
+  for (uint32_t i = 0; i < h->nfiles; i++) {
+    const IdxFile *f = &ix->files[i];
+    if (f->name >= h->names_len || f->first_block > h->nblocks ||
+        f->nblocks > h->nblocks - f->first_block)
+      goto bad;
+    for (uint64_t b = 0; b < f->nblocks; b++) {
+      uint64_t off = ix->blocks[f->first_block + b];
+      uint64_t end = b + 1 < f->nblocks ? ix->blocks[f->first_block + b + 1]
+                                        : f->size;
+      if (off > end || end > f->size)
+        goto bad;
+    }
+  }
+  for (uint32_t t = 0; t < h->ntri; t++)
+    if (ix->tris[t].off > h->post_len ||
+        ix->tris[t].count > h->post_len - ix->tris[t].off)
+      goto bad;
+  return 0;
+bad:
+  munmap(ix->map, ix->len);
+  ix->map = NULL;
+  errno = EINVAL;
+  return -1;
+}
+
+static void idx_unload(Index *ix) {
+  if (ix->map)
+    munmap(ix->map, ix->len);
+  ix->map = NULL;
+}
+
+static const IdxFile *idx_find_file(const Index *ix, const char *path) {
+  size_t lo = 0, hi = ix->map ? ix->h->nfiles : 0;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    int c = strcmp(ix->names + ix->files[mid].name, path);
+    if (c == 0)
+      return &ix->files[mid];
+    if (c < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return NULL;
+}
+
+static int idx_fresh(const IdxFile *f, const struct stat *st) {
+  return f->size == (uint64_t)st->st_size &&
+         f->mtime_sec == (int64_t)st->st_mtim.tv_sec &&
+         f->mtime_nsec == (int64_t)st->st_mtim.tv_nsec;
+}
+
+// Decodes the posting list of tri into *v, which is NULL with *n = 0 if
+// no block holds it. Returns -1 with errno set if the list is corrupt or
+// memory runs out.
+static int idx_postings(const Index *ix, uint32_t tri, uint32_t **v,
+                        size_t *n) {
+  size_t lo = 0, hi = ix->h->ntri;
+  *v = NULL;
+  *n = 0;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (ix->tris[mid].tri < tri)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if (lo == ix->h->ntri || ix->tris[lo].tri != tri)
+    return 0;
+  const IdxTri *t = &ix->tris[lo];
+  uint32_t *out = malloc((t->count ? t->count : 1) * sizeof(*out));
+  if (!out)
+    return -1;
+  const unsigned char *p = ix->post + t->off;
+  const unsigned char *end = ix->post + ix->h->post_len;
+  uint64_t block = 0;
+  for (uint32_t i = 0; i < t->count; i++) {
+    uint64_t d = 0;
+    for (int shift = 0;; shift += 7) {
+      if (p == end || shift > 28) {
+        free(out);
+        errno = EINVAL;
+        return -1;
+      }
+      d |= (uint64_t)(*p & 0x7f) << shift;
+      if (!(*p++ & 0x80))
+        break;
+    }
+    block += d;
+    if (block >= ix->h->nblocks) {
+      free(out);
+      errno = EINVAL;
+      return -1;
+    }
+    out[i] = (uint32_t)block;
+  }
+  *v = out;
+  *n = t->count;
+  return 0;
+}
+
+typedef struct {
+  uint64_t *v; // trigram << 32 | block
+  size_t n, cap;
+} Pairs;
+
+static int pairs_add(Pairs *p, uint32_t tri, uint64_t block) {
+  if (p->n == p->cap) {
+    size_t cap = p->cap ? p->cap * 2 : 1 << 16;
+    uint64_t *v = realloc(p->v, cap * sizeof(*v));
+    if (!v)
+      return -1;
+    p->v = v;
+    p->cap = cap;
+  }
+  p->v[p->n++] = (uint64_t)tri << 32 | block;
+  return 0;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+static int cmp_u32(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+// Adds the distinct in-line trigrams of [p, p + n) for block. seen is a
+// 2^24 bit scratch map that is left clear again.
+static int idx_scan_block(const char *p, size_t n, uint64_t block,
+                          Pairs *pairs, uint8_t *seen) {
+  size_t first = pairs->n, run = 0;
+  uint32_t tri = 0;
+  for (size_t i = 0; i < n; i++) {
+    unsigned char c = (unsigned char)p[i];
+    tri = ((tri << 8) | c) & 0xffffff;
+    if (c == '\n') {
+      run = 0;
+      continue;
+    }
+    if (++run < 3 || (seen[tri >> 3] >> (tri & 7)) & 1)
+      continue;
+    seen[tri >> 3] |= 1 << (tri & 7);
+    if (pairs_add(pairs, tri, block) < 0)
+      return -1;
+  }
+  for (size_t i = first; i < pairs->n; i++) {
+    uint32_t t = (uint32_t)(pairs->v[i] >> 32);
+    seen[t >> 3] &= (uint8_t) ~(1 << (t & 7));
+  }
+  return 0;
+}
+
+typedef struct {
+  char *path;
+  struct stat st;
+  const IdxFile *old; // unchanged entry of the previous index
+  uint64_t first_block, nblocks;
+} IdxSource;
+
+typedef struct {
+  IdxSource *v;
+  size_t n, cap;
+} Sources;
+
+// Collects the regular files under dir. Only the top directory must be
+// readable: unreadable subdirectories are reported and skipped.
+static int idx_walk(const char *dir, Sources *s, int top) {
+  DIR *d = opendir(dir);
+  if (!d) {
+    fprintf(stderr, "mygrep: cannot open %s: %s\n", dir, strerror(errno));
+    return top ? -1 : 0;
+  }
+  struct dirent *e;
+  int ret = 0;
+  while (ret == 0 && (e = readdir(d)) != NULL) {
+    if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0 ||
+        strncmp(e->d_name, IDX_NAME, sizeof(IDX_NAME) - 1) == 0)
+      continue;
+    size_t len = strlen(dir) + strlen(e->d_name) + 2;
+    char *path = malloc(len);
+    if (!path) {
+      ret = -1;
+      break;
+    }
+    snprintf(path, len, "%s/%s", dir, e->d_name);
+    struct stat st;
+    if (lstat(path, &st) < 0) {
+      fprintf(stderr, "mygrep: cannot stat %s: %s\n", path, strerror(errno));
+      free(path);
+      continue;
+    }
+    if (S_ISDIR(st.st_mode)) {
+      ret = idx_walk(path, s, 0);
+      free(path);
+      continue;
+    }
+    if (!S_ISREG(st.st_mode)) {
+      free(path);
+      continue;
+    }
+    if (s->n == s->cap) {
+      size_t cap = s->cap ? s->cap * 2 : 64;
+      IdxSource *v = realloc(s->v, cap * sizeof(*v));
+      if (!v) {
+        free(path);
+        ret = -1;
+        break;
+      }
+      s->v = v;
+      s->cap = cap;
+    }
+    s->v[s->n++] = (IdxSource){.path = path, .st = st};
+  }
+  closedir(d);
+  return ret;
+}
+
+static int cmp_source(const void *a, const void *b) {
+  return strcmp(((const IdxSource *)a)->path, ((const IdxSource *)b)->path);
+}
+
+// Cuts a new or changed file into blocks and collects its trigrams.
+static int idx_scan_file(IdxSource *src, uint64_t first, Pairs *pairs,
+                         uint64_t **blocks, size_t *nblocks, size_t *cap,
+                         uint8_t *seen) {
+  src->first_block = first;
+  src->nblocks = 0;
+  if (src->st.st_size == 0)
+    return 0;
+  int fd = open(src->path, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "mygrep: cannot open %s: %s\n", src->path,
+            strerror(errno));
+    return -1;
+  }
+  size_t size = (size_t)src->st.st_size;
+  char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    fprintf(stderr, "mygrep: cannot map %s: %s\n", src->path,
+            strerror(errno));
+    return -1;
+  }
+  if (input_compressed(map, size)) { // searched in full, decoded
+    munmap(map, size);
+    return 0;
+  }
+  madvise(map, size, MADV_SEQUENTIAL);
+  int ret = 0;
+  for (size_t off = 0; off < size && ret == 0;) {
+    size_t end = size - off > IDX_BLOCK ? off + IDX_BLOCK : size;
+    const char *nl = memchr(map + end - 1, '\n', size - end + 1);
+    end = nl ? (size_t)(nl + 1 - map) : size;
+    if (*nblocks == *cap) {
+      size_t c = *cap ? *cap * 2 : 1024;
+      uint64_t *v = realloc(*blocks, c * sizeof(*v));
+      if (!v) {
+        ret = -1;
+        break;
+      }
+      *blocks = v;
+      *cap = c;
+    }
+    (*blocks)[(*nblocks)++] = off;
+    ret = idx_scan_block(map + off, end - off, first + src->nblocks++, pairs,
+                         seen);
+    off = end;
+  }
+  munmap(map, size);
+  if (ret < 0)
+    fprintf(stderr, "mygrep: out of memory\n");
+  return ret;
+}
+
+static int idx_write(const char *path, const Sources *s, const uint64_t *blocks,
+                     size_t nblocks, const Pairs *pairs) {
+  IdxHeader h = {.magic = IDX_MAGIC};
+  IdxTri *tris = NULL;
+  unsigned char *post = malloc(pairs->n * 5 + 1);
+  size_t ntri = 0, post_len = 0, tcap = 0;
+  int ret = -1;
+  if (!post)
+    goto out;
+  for (size_t i = 0; i < pairs->n;) {
+    uint32_t tri = (uint32_t)(pairs->v[i] >> 32);
+    if (ntri == tcap) {
+      tcap = tcap ? tcap * 2 : 4096;
+      IdxTri *t = realloc(tris, tcap * sizeof(*t));
+      if (!t)
+        goto out;
+      tris = t;
+    }
+    IdxTri *t = &tris[ntri++];
+    t->tri = tri;
+    t->count = 0;
+    t->off = post_len;
+    uint32_t prev = 0;
+    for (; i < pairs->n && (uint32_t)(pairs->v[i] >> 32) == tri; i++) {
+      uint32_t block = (uint32_t)pairs->v[i];
+      uint32_t d = block - prev;
+      prev = block;
+      while (d >= 0x80) {
+        post[post_len++] = (unsigned char)(d | 0x80);
+        d >>= 7;
+      }
+      post[post_len++] = (unsigned char)d;
+      t->count++;
+    }
+  }
+
+  FILE *f = fopen(path, "wb");
+  if (!f) {
+    fprintf(stderr, "mygrep: cannot create %s: %s\n", path, strerror(errno));
+    goto out;
+  }
+  h.nfiles = (uint32_t)s->n;
+  h.ntri = (uint32_t)ntri;
+  h.nblocks = nblocks;
+  for (size_t i = 0; i < s->n; i++)
+    h.names_len += strlen(s->v[i].path) + 1;
+  h.post_len = post_len;
+  fwrite(&h, sizeof(h), 1, f);
+  uint64_t name = 0;
+  for (size_t i = 0; i < s->n; i++) {
+    const IdxSource *src = &s->v[i];
+    IdxFile e = {
+        .size = (uint64_t)src->st.st_size,
+        .mtime_sec = (int64_t)src->st.st_mtim.tv_sec,
+        .mtime_nsec = (int64_t)src->st.st_mtim.tv_nsec,
+        .name = name,
+        .first_block = src->first_block,
+        .nblocks = src->nblocks,
+    };
+    fwrite(&e, sizeof(e), 1, f);
+    name += strlen(src->path) + 1;
+  }
+  fwrite(blocks, sizeof(*blocks), nblocks, f);
+  fwrite(tris, sizeof(*tris), ntri, f);
+  for (size_t i = 0; i < s->n; i++)
+    fwrite(s->v[i].path, 1, strlen(s->v[i].path) + 1, f);
+  fwrite(post, 1, post_len, f);
+  if (ferror(f) | (fclose(f) != 0)) {
+    fprintf(stderr, "mygrep: write error on %s\n", path);
+    goto out;
+  }
+  ret = 0;
+out:
+  if (ret < 0 && !post)
+    fprintf(stderr, "mygrep: out of memory\n");
+  free(tris);
+  free(post);
+  return ret;
+}
+
+// --index DIR: builds or refreshes DIR/.mygrep-index.
+static int build_index(const char *dir) {
+  char *real = realpath(dir, NULL);
+  char *path = real ? idx_path(real, "") : NULL;
+  char *tmp = real ? idx_path(real, ".tmp") : NULL;
+  Sources s = {0};
+  Pairs pairs = {0};
+  uint64_t *blocks = NULL;
+  size_t nblocks = 0, bcap = 0, rescanned = 0;
+  uint8_t *seen = calloc(1 << 21, 1);
+  uint64_t *remap = NULL;
+  Index old = {0};
+  int ret = 1;
+
+  if (!real) {
+    fprintf(stderr, "mygrep: cannot open %s: %s\n", dir, strerror(errno));
+    return 1;
+  }
+  if (!path || !tmp || !seen || idx_walk(real, &s, 1) < 0)
+    goto out;
+  qsort(s.v, s.n, sizeof(*s.v), cmp_source);
+  if (idx_load(path, &old) < 0 && errno != ENOENT)
+    fprintf(stderr, "mygrep: ignoring unreadable index %s\n", path);
+
+  // Unchanged files keep their blocks under new numbers; the others are
+  // read again.
+  if (old.map && !(remap = malloc((old.h->nblocks + 1) * sizeof(*remap))))
+    goto out;
+  for (uint64_t b = 0; old.map && b < old.h->nblocks; b++)
+    remap[b] = UINT64_MAX;
+  for (size_t i = 0; i < s.n; i++) {
+    IdxSource *src = &s.v[i];
+    const IdxFile *f = idx_find_file(&old, src->path);
+    if (f && idx_fresh(f, &src->st)) {
+      src->old = f;
+      src->first_block = nblocks;
+      src->nblocks = f->nblocks;
+      for (uint64_t b = 0; b < f->nblocks; b++) {
+        if (nblocks == bcap) {
+          size_t c = bcap ? bcap * 2 : 1024;
+          uint64_t *v = realloc(blocks, c * sizeof(*v));
+          if (!v)
+            goto out;
+          blocks = v;
+          bcap = c;
+        }
+        remap[f->first_block + b] = nblocks;
+        blocks[nblocks++] = old.blocks[f->first_block + b];
+      }
+    } else {
+      if (idx_scan_file(src, nblocks, &pairs, &blocks, &nblocks, &bcap,
+                        seen) < 0)
+        goto out;
+      rescanned++;
+    }
+    if (nblocks > UINT32_MAX) {
+      fprintf(stderr, "mygrep: too many blocks to index\n");
+      goto out;
+    }
+  }
+  for (uint32_t t = 0; old.map && t < old.h->ntri; t++) {
+    uint32_t *v;
+    size_t n;
+    if (idx_postings(&old, old.tris[t].tri, &v, &n) < 0) {
+      if (errno == EINVAL)
+        fprintf(stderr, "mygrep: corrupt index %s\n", path);
+      goto out;
+    }
+    for (size_t i = 0; i < n; i++)
+      if (remap[v[i]] != UINT64_MAX &&
+          pairs_add(&pairs, old.tris[t].tri, remap[v[i]]) < 0) {
+        free(v);
+        goto out;
+      }
+    free(v);
+  }
+  qsort(pairs.v, pairs.n, sizeof(*pairs.v), cmp_u64);
+  if (idx_write(tmp, &s, blocks, nblocks, &pairs) < 0) {
+    unlink(tmp);
+    goto out;
+  }
+  if (rename(tmp, path) < 0) {
+    fprintf(stderr, "mygrep: cannot rename %s: %s\n", tmp, strerror(errno));
+    unlink(tmp);
+    goto out;
+  }
+  printf("indexed %zu files, %zu rescanned, %zu blocks\n", s.n, rescanned,
+         nblocks);
+  ret = 0;
+out:
+  if (ret && (!path || !tmp || !seen))
+    fprintf(stderr, "mygrep: out of memory\n");
+  idx_unload(&old);
+  for (size_t i = 0; i < s.n; i++)
+    free(s.v[i].path);
+  free(s.v);
+  free(pairs.v);
+  free(blocks);
+  free(remap);
+  free(seen);
+  free(tmp);
+  free(path);
+  free(real);
+  return ret;
+}
+
+// Appends the trigrams of a literal run to tris; runs shorter than three
+// bytes say nothing.
+static int add_run(const char *run, size_t n, uint32_t **tris, size_t *ntris) {
+  if (n < 3)
+    return 0;
+  uint32_t *v = realloc(*tris, (*ntris + n - 2) * sizeof(*v));
+  if (!v)
+    return -1;
+  *tris = v;
+  for (size_t i = 0; i + 2 < n; i++)
+    v[(*ntris)++] = (uint32_t)(unsigned char)run[i] << 16 |
+                    (uint32_t)(unsigned char)run[i + 1] << 8 |
+                    (unsigned char)run[i + 2];
+  return 0;
+}
+
+// Trigrams every match of pat contains. For a regex these come from the
+// literal runs outside groups and brackets that no operator makes
+// optional; a top level alternation gives none. Returns 1 if there are
+// any, 0 if the pattern cannot be pruned and -1 on allocation failure.
+static int required_trigrams(const char *pat, int regex, uint32_t **tris,
+                             size_t *ntris) {
+  size_t len = strlen(pat), n = 0;
+  char *run = malloc(len + 1);
+  int depth = 0, ret = 0;
+  *tris = NULL;
+  *ntris = 0;
+  if (!run)
+    return -1;
+  if (!regex) {
+    ret = add_run(pat, len, tris, ntris);
+    goto out;
+  }
+  for (const char *p = pat; *p && ret == 0; p++) {
+    char c = *p;
+    if (c == '\\' && p[1]) {
+      c = *++p;
+      if (depth == 0 && !strchr("wWsSdD", c)) {
+        run[n++] = c;
+        continue;
+      }
+    } else if (c == '[') {
+      const char *q = p + 1 + (p[1] == '^');
+      q += *q == ']';
+      while (*q && *q != ']') {
+        const char *close =
+            q[0] == '[' && q[1] == ':' ? strstr(q + 2, ":]") : NULL;
+        q = close ? close + 2 : q + 1;
+      }
+      if (!*q)
+        break;
+      p = q;
+    } else if (c == '(') {
+      depth++;
+    } else if (c == ')') {
+      depth -= depth > 0;
+    } else if (c == '|' && depth == 0) {
+      free(*tris);
+      *tris = NULL;
+      *ntris = 0;
+      goto out;
+    } else if (c == '{' && depth == 0) {
+      // A brace that does not start a bound is a literal, as in
+      // re_piece(); a bound may allow zero copies of the byte before.
+      Regex r = {.p = p, .end = pat + len};
+      int lo, hi;
+      if (re_bounds(&r, &lo, &hi) <= 0) {
+        run[n++] = c;
+        continue;
+      }
+      p = r.p - 1;
+      n -= n > 0;
+    } else if (depth == 0 && !strchr(".^$*+?", c)) {
+      run[n++] = c;
+      continue;
+    } else if (depth == 0 && strchr("*?", c) && n > 0) {
+      n--; // the byte before is optional
+    }
+    ret = add_run(run, n, tris, ntris);
+    n = 0;
+  }
+  if (ret == 0)
+    ret = add_run(run, n, tris, ntris);
+out:
+  free(run);
+  if (ret < 0)
+    return -1;
+  return *ntris > 0;
+}
+
+// Marks the blocks that may hold a match of some pattern. Returns NULL
+// in *cand if some pattern cannot be pruned, so every block is a
+// candidate.
+static int idx_candidates(const Index *ix, int regex, uint8_t **cand) {
+  *cand = calloc(ix->h->nblocks + 1, 1);
+  if (!*cand)
+    return -1;
+  for (size_t i = 0; i < npats; i++) {
+    uint32_t *tris, *hits = NULL;
+    size_t ntris, nhits = 0;
+    int k = required_trigrams(pats[i], regex, &tris, &ntris);
+    if (k <= 0) {
+      free(*cand);
+      *cand = NULL;
+      return k;
+    }
+    qsort(tris, ntris, sizeof(*tris), cmp_u32);
+    for (size_t t = 0; t < ntris; t++) {
+      if (t > 0 && tris[t] == tris[t - 1])
+        continue;
+      uint32_t *v;
+      size_t n;
+      if (idx_postings(ix, tris[t], &v, &n) < 0) {
+        free(hits);
+        free(tris);
+        free(*cand);
+        *cand = NULL;
+        return -1;
+      }
+      if (!hits) {
+        hits = v;
+        nhits = n;
       } else {
-        FILE *fp = fopen(argv[i], "rb");
-        if (!fp) {
-          fprintf(stderr, "mygrep: cannot open %s: %s\n", argv[i],
-                  strerror(errno));
-          status = 1;
-          continue;
+        size_t a = 0, b = 0, out = 0;
+        while (a < nhits && b < n) {
+          if (hits[a] < v[b])
+            a++;
+          else if (hits[a] > v[b])
+            b++;
+          else
+            hits[out++] = hits[a++], b++;
         }
-        status |= grep_stream(fp, argv[i], pattern);
-        fclose(fp);
+        nhits = out;
+        free(v);
       }
+      if (nhits == 0)
+        break;
     }
+    for (size_t h = 0; h < nhits; h++)
+      (*cand)[hits[h]] = 1;
+    free(hits);
+    free(tris);
+  }
+  return 0;
+}
+
+// Searches the candidate blocks of an indexed file; block boundaries are
+// line boundaries, so the result is the same as a full scan.
+static int grep_blocks(const Index *ix, const IdxFile *f, const char *name,
+                       const uint8_t *cand) {
+  int fd = open(name, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "mygrep: cannot open %s: %s\n", name, strerror(errno));
+    return 1;
+  }
+  long hits = 0, limit = line_limit();
+  char *map = NULL;
+  size_t size = f->size;
+  struct stat st;
+  if (fstat(fd, &st) < 0 || !idx_fresh(f, &st) ||
+      (size && (map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0)) ==
+                   MAP_FAILED)) {
+    // Changed since it was indexed.
+    close(fd);
+    return grep_path(name);
+  }
+  close(fd);
+  if (map)
+    madvise(map, size, MADV_RANDOM);
+  for (uint64_t b = 0; b < f->nblocks && hits < limit; b++) {
+    uint64_t id = f->first_block + b;
+    if (!cand[id])
+      continue;
+    uint64_t end = b + 1 < f->nblocks ? ix->blocks[id + 1] : size;
+    hits += grep_block(&matcher, map + ix->blocks[id], map + end,
+                       limit - hits, NULL);
+  }
+  if (map)
+    munmap(map, size);
+  found |= hits > 0;
+  summarize(name, hits, NULL);
+  return 0;
+}
+
+// --use-index DIR: searches the named files, or every indexed one, with
+// the index in DIR. Files it does not know, that changed since or that
+// are compressed are searched in full.
+static int grep_indexed(const char *dir, char **names, int n, int regex) {
+  char *path = idx_path(dir, "");
+  Index ix;
+  uint8_t *cand = NULL;
+  int status = 0;
+
+  if (!path || idx_load(path, &ix) < 0) {
+    fprintf(stderr, "mygrep: cannot load index %s: %s\n", path ? path : dir,
+            strerror(path ? errno : ENOMEM));
+    free(path);
+    return 1;
+  }
+  if (idx_candidates(&ix, regex, &cand) < 0) {
+    fprintf(stderr, "mygrep: cannot use index %s: %s\n", path,
+            strerror(errno));
+    status = 1;
+    goto out;
+  }
+  if (n == 0)
+    mode.names = ix.h->nfiles > 1;
+  int nnames = n ? n : (int)ix.h->nfiles;
+  for (int i = 0; i < nnames && !quitting(); i++) {
+    const IdxFile *f = n ? NULL : &ix.files[i];
+    const char *name = n ? names[i] : ix.names + f->name;
+    if (n && strcmp(name, "-") != 0) {
+      char *real = realpath(name, NULL);
+      f = real ? idx_find_file(&ix, real) : NULL;
+      free(real);
+    }
+    if (f && cand && f->nblocks)
+      status |= grep_blocks(&ix, f, name, cand);
+    else
+      status |= grep_path(name);
+  }
+out:
+  free(cand);
+  idx_unload(&ix);
+  free(path);
+  return status;
+}
+
+int main(int argc, char **argv) {
+  static const struct option longopts[] = {
+      {"index", required_argument, NULL, 'I'},
+      {"use-index", required_argument, NULL, 'U'},
+      {NULL, 0, NULL, 0},
+  };
+  const char *index_dir = NULL, *use_index = NULL;
+  int regex = 0, have_patterns = 0, jobs = 1, opt;
+
+  while ((opt = getopt_long(argc, argv, "+Eclqm:e:f:j:", longopts, NULL)) !=
+         -1) {
+    switch (opt) {
+    case 'I':
+      index_dir = optarg;
+      break;
+    case 'U':
+      use_index = optarg;
+      break;
+    case 'E':
+      regex = 1;
+      break;
+    case 'c':
+      mode.count = 1;
+      break;
+    case 'l':
+      mode.list = 1;
+      break;
+    case 'q':
+      mode.quiet = 1;
+      break;
+    case 'm': {
+      char *end;
+      mode.max = strtol(optarg, &end, 10);
+      if (*optarg == '\0' || *end != '\0' || mode.max < 0) {
+        usage(argv[0]);
+        return 2;
+      }
+      break;
+    }
+    case 'e':
+      if (add_patterns(optarg, strlen(optarg), 0) < 0) {
+        fprintf(stderr, "mygrep: out of memory\n");
+        return 2;
+      }
+      have_patterns = 1;
+      break;
+    case 'f':
+      if (read_pattern_file(optarg) < 0)
+        return 2;
+      have_patterns = 1;
+      break;
+    case 'j':
+      jobs = atoi(optarg);
+      if (jobs < 1 || jobs > MAX_JOBS) {
+        usage(argv[0]);
+        return 2;
+      }
+      break;
+    default:
+      usage(argv[0]);
+      return 2;
+    }
+  }
+  if (jobs > 1 && (index_dir || use_index)) {
+    fprintf(stderr, "mygrep: -j cannot be combined with --index or "
+                    "--use-index\n");
+    return 2;
+  }
+  if (index_dir) {
+    if (optind != argc) {
+      usage(argv[0]);
+      return 2;
+    }
+    return build_index(index_dir);
+  }
+  if (!have_patterns) {
+    if (optind >= argc) {
+      usage(argv[0]);
+      return 2;
+    }
+    if (add_patterns(argv[optind], strlen(argv[optind]), 0) < 0) {
+      fprintf(stderr, "mygrep: out of memory\n");
+      return 2;
+    }
+    optind++;
+  }
+  if (mode.max == 0) // nothing is wanted, not even a count
+    return mode.quiet ? 1 : 0;
+  find = pick_find();
+  if (matcher_init(&matcher, pats, npats, regex) < 0)
+    return 2;
+
+  int status = 0;
+
+  mode.names = argc - optind > 1;
+  if (use_index) {
+    status = grep_indexed(use_index, argv + optind, argc - optind, regex);
+  } else if (optind == argc) {
+    status = grep_path("-");
+  } else if (jobs > 1) {
+    status = grep_parallel(argv + optind, argc - optind, jobs);
+  } else {
+    for (int i = optind; i < argc && !quitting(); i++)
+      status |= grep_path(argv[i]);
   }
+  // -q answers with the status alone, and a match wins over errors.
+  if (mode.quiet)
+    return quitting() ? 0 : status ? 2 : 1;
   return status ? 1 : 0;
 }
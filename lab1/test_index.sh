@@ -0,0 +1,20 @@
+#!/bin/sh
+# Checks that mygrep --use-index finds exactly what a full scan finds.
+set -e
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+printf 'xx abccdef yy\nabc{2}def\nab{x\nabdef\ncolour\ncolor\nfoo bar\nbaz qux\n' \
+  >"$dir/a.txt"
+seq 1 20000 | sed 's/$/ filler line/' >"$dir/b.txt"
+./mygrep --index "$dir" >/dev/null
+fail=0
+for pat in 'abc{2}def' 'abc{1,3}de' 'ab{x' 'abc?def' 'abc*def' 'colou?r' \
+  'colo(u)*r' 'foo|qux' 'xx|abd' '19{2,}7 filler' '1234?5'; do
+  want=$(./mygrep -E "$pat" "$dir/a.txt" "$dir/b.txt")
+  got=$(./mygrep -E --use-index "$dir" "$pat" "$dir/a.txt" "$dir/b.txt")
+  if [ "$want" != "$got" ]; then
+    echo "FAIL: $pat" >&2
+    fail=1
+  fi
+done
+exit $fail
@@ -0,0 +1,543 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
+#include <math.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ptrace.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// Benchmarks ./archiver on synthetic corpora and prints the results as
+// JSON. Every operation is timed over a few runs (best run counts), and
+// run once more under ptrace to count system calls. With a baseline file
+// the results are compared and a drop beyond the threshold fails the run.
+
+#define MAX_RESULTS 64
+
+struct corpus {
+  const char *name;
+  size_t files;
+  size_t min_size;
+  size_t max_size;
+};
+
+// Sizes at scale 100: 20000 tiny files, 2 huge ones, 2000 mixed.
+static const struct corpus corpora[] = {
+    {"tiny", 20000, 64, 2048},
+    {"huge", 2, 128u << 20, 128u << 20},
+    {"mixed", 2000, 1024, 1u << 20},
+};
+
+static const char *codecs[] = {"none", "lz4"};
+
+struct result {
+  char corpus[16];
+  char codec[16];
+  char op[16];
+  uint64_t files;
+  uint64_t bytes;
+  double seconds;
+  long syscalls; // -1 when ptrace is not allowed
+  long peak_rss_kb;
+};
+
+static struct result results[MAX_RESULTS];
+static size_t nresults;
+static const char *archiver = "./archiver";
+static int repeat = 3;
+static char work[PATH_MAX]; // absolute work directory while it exists
+
+static void die(const char *msg) {
+  perror(msg);
+  exit(EXIT_FAILURE);
+}
+
+static int remove_entry(const char *path, const struct stat *st, int type,
+                        struct FTW *ftw) {
+  (void)st;
+  (void)type;
+  (void)ftw;
+  return remove(path);
+}
+
+// Deletes the work directory; also run at exit so that failures don't
+// leave the corpus behind.
+static void remove_work(void) {
+  if (!*work)
+    return;
+  if (nftw(work, remove_entry, 16, FTW_DEPTH | FTW_PHYS) != 0)
+    fprintf(stderr, "archbench: could not remove %s\n", work);
+  *work = '\0';
+}
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15ull;
+
+static uint64_t rng(void) {
+  uint64_t x = rng_state;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  return rng_state = x;
+}
+
+// Half of the files are text-like and compress well, half are random.
+static void fill(uint8_t *buf, size_t len, int text) {
+  static const char *words[] = {"archive", "member ", "index ",  "block ",
+                                "header ", "offset ", "\n",      "copy ",
+                                "stream ", "error ",  "record ", "name "};
+  size_t i = 0;
+  while (i < len) {
+    if (text) {
+      const char *w = words[rng() % 12];
+      for (; *w && i < len; w++)
+        buf[i++] = (uint8_t)*w;
+    } else {
+      uint64_t r = rng();
+      for (int k = 0; k < 8 && i < len; k++, r >>= 8)
+        buf[i++] = (uint8_t)r;
+    }
+  }
+}
+
+static void write_file(const char *path, size_t len, uint8_t *buf,
+                       size_t cap) {
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    die(path);
+  int text = rng() & 1;
+  while (len > 0) {
+    size_t n = len < cap ? len : cap;
+    fill(buf, n, text);
+    if (write(fd, buf, n) != (ssize_t)n)
+      die("write corpus");
+    len -= n;
+  }
+  close(fd);
+}
+
+// Creates dir/<name>/ with the corpus files, spread over subdirectories,
+// and a list of their member names for -T. Returns the content bytes.
+static uint64_t make_corpus(const char *dir, const struct corpus *c,
+                            int scale, size_t *nfiles) {
+  char path[4096];
+  snprintf(path, sizeof(path), "%s/%s", dir, c->name);
+  mkdir(path, 0755);
+  snprintf(path, sizeof(path), "%s/%s.list", dir, c->name);
+  FILE *list = fopen(path, "w");
+  if (!list)
+    die(path);
+  size_t n = c->files * (size_t)scale / 100;
+  size_t max_size = c->max_size;
+  if (c->files < 10) { // few huge files: scale their size instead
+    n = c->files;
+    max_size = max_size * (size_t)scale / 100;
+  }
+  size_t min_size = c->min_size < max_size ? c->min_size : max_size;
+  if (n == 0)
+    n = 1;
+  size_t cap = 1u << 20;
+  uint8_t *buf = (uint8_t *)malloc(cap);
+  if (!buf)
+    die("malloc");
+  uint64_t total = 0;
+  for (size_t i = 0; i < n; i++) {
+    snprintf(path, sizeof(path), "%s/%s/d%zu", dir, c->name, i % 64);
+    mkdir(path, 0755);
+    size_t len = min_size;
+    if (max_size > min_size) // log-uniform between the bounds
+      len = (size_t)((double)min_size *
+                     pow((double)max_size / (double)min_size,
+                         (double)(rng() % 1000) / 1000.0));
+    snprintf(path, sizeof(path), "%s/%s/d%zu/f%zu", dir, c->name, i % 64,
+             i);
+    write_file(path, len, buf, cap);
+    fprintf(list, "%s/d%zu/f%zu\n", c->name, i % 64, i);
+    total += len;
+  }
+  free(buf);
+  fclose(list);
+  *nfiles = n;
+  return total;
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static pid_t spawn(char **argv, int traced) {
+  pid_t pid = fork();
+  if (pid < 0)
+    die("fork");
+  if (pid == 0) {
+    int null = open("/dev/null", O_WRONLY);
+    if (null >= 0) {
+      dup2(null, STDOUT_FILENO);
+      close(null);
+    }
+    if (traced) {
+      if (ptrace(PTRACE_TRACEME, 0, NULL, NULL) < 0)
+        _exit(126);
+      raise(SIGSTOP);
+    }
+    execv(argv[0], argv);
+    _exit(127);
+  }
+  return pid;
+}
+
+// Runs argv once; returns the wall time and the child's peak RSS.
+static double run_timed(char **argv, long *peak_rss_kb) {
+  double t0 = now();
+  pid_t pid = spawn(argv, 0);
+  int status;
+  struct rusage ru;
+  if (wait4(pid, &status, 0, &ru) < 0)
+    die("wait4");
+  double t = now() - t0;
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    fprintf(stderr, "archbench: %s %s failed\n", argv[0], argv[2]);
+    exit(EXIT_FAILURE);
+  }
+  if (ru.ru_maxrss > *peak_rss_kb)
+    *peak_rss_kb = ru.ru_maxrss;
+  return t;
+}
+
+// Runs argv under ptrace and counts syscall entries in all its threads.
+// Returns -1 when tracing is not permitted.
+static long run_traced(char **argv) {
+  pid_t pid = spawn(argv, 1);
+  int status;
+  if (waitpid(pid, &status, 0) < 0)
+    die("waitpid");
+  if (WIFEXITED(status)) // PTRACE_TRACEME refused
+    return -1;
+  if (ptrace(PTRACE_SETOPTIONS, pid, NULL,
+             (void *)(long)(PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACECLONE |
+                            PTRACE_O_EXITKILL)) < 0) {
+    kill(pid, SIGKILL);
+    waitpid(pid, &status, 0);
+    return -1;
+  }
+  ptrace(PTRACE_SYSCALL, pid, NULL, NULL);
+  long stops = 0;
+  for (;;) {
+    pid_t t = waitpid(-1, &status, __WALL);
+    if (t < 0) {
+      if (errno == EINTR)
+        continue;
+      break; // ECHILD: all threads are gone
+    }
+    if (!WIFSTOPPED(status))
+      continue;
+    int sig = WSTOPSIG(status);
+    if (sig == (SIGTRAP | 0x80)) {
+      stops++;
+      sig = 0;
+    } else if (sig == SIGTRAP || sig == SIGSTOP) {
+      sig = 0; // ptrace events and new threads starting
+    }
+    ptrace(PTRACE_SYSCALL, t, NULL, (void *)(long)sig);
+  }
+  // Each call stops on entry and exit, except exit_group.
+  return (stops + 1) / 2;
+}
+
+static void copy_file(const char *from, const char *to) {
+  int in = open(from, O_RDONLY);
+  if (in < 0)
+    die(from);
+  int out = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (out < 0)
+    die(to);
+  char buf[1 << 16];
+  ssize_t r;
+  while ((r = read(in, buf, sizeof(buf))) > 0)
+    if (write(out, buf, (size_t)r) != r)
+      die("write");
+  if (r < 0)
+    die("read");
+  close(in);
+  close(out);
+}
+
+// Measures one operation. `before` restores the archive state the
+// operation expects: NULL (nothing), "" (no archive) or a saved copy.
+static void measure(const char *corpus, const char *codec, const char *op,
+                    char **argv, const char *arch, const char *before,
+                    uint64_t files, uint64_t bytes) {
+  if (nresults == MAX_RESULTS) {
+    fprintf(stderr, "archbench: too many results\n");
+    exit(EXIT_FAILURE);
+  }
+  struct result *r = &results[nresults++];
+  memset(r, 0, sizeof(*r));
+  snprintf(r->corpus, sizeof(r->corpus), "%s", corpus);
+  snprintf(r->codec, sizeof(r->codec), "%s", codec);
+  snprintf(r->op, sizeof(r->op), "%s", op);
+  r->files = files;
+  r->bytes = bytes;
+  r->seconds = -1;
+  for (int i = 0; i <= repeat; i++) {
+    if (before && *before)
+      copy_file(before, arch);
+    else if (before)
+      unlink(arch);
+    if (i == repeat) { // last round: count syscalls
+      r->syscalls = run_traced(argv);
+      break;
+    }
+    double t = run_timed(argv, &r->peak_rss_kb);
+    if (r->seconds < 0 || t < r->seconds)
+      r->seconds = t;
+  }
+  fprintf(stderr, "%-6s %-5s %-8s %9.4f s\n", corpus, codec, op, r->seconds);
+}
+
+static double rate(uint64_t n, double seconds) {
+  return seconds > 0 ? (double)n / seconds : 0;
+}
+
+static void print_json(FILE *f) {
+  fprintf(f, "{\n  \"archiver_bench\": 1,\n  \"results\": [\n");
+  for (size_t i = 0; i < nresults; i++) {
+    const struct result *r = &results[i];
+    fprintf(f,
+            "    {\"corpus\": \"%s\", \"codec\": \"%s\", \"op\": \"%s\", "
+            "\"files\": %lu, \"bytes\": %lu, \"seconds\": %.6f, "
+            "\"mb_per_s\": %.2f, \"files_per_s\": %.1f, ",
+            r->corpus, r->codec, r->op, (unsigned long)r->files,
+            (unsigned long)r->bytes, r->seconds,
+            rate(r->bytes, r->seconds) / 1e6, rate(r->files, r->seconds));
+    if (r->syscalls < 0)
+      fprintf(f, "\"syscalls\": null, ");
+    else
+      fprintf(f, "\"syscalls\": %ld, ", r->syscalls);
+    fprintf(f, "\"peak_rss_kb\": %ld}%s\n", r->peak_rss_kb,
+            i + 1 < nresults ? "," : "");
+  }
+  fprintf(f, "  ]\n}\n");
+}
+
+// Reads a number after "key": on a result line; returns -1 if absent
+// or null.
+static double json_num(const char *line, const char *key) {
+  char pat[64];
+  snprintf(pat, sizeof(pat), "\"%s\": ", key);
+  const char *p = strstr(line, pat);
+  if (!p || !strncmp(p + strlen(pat), "null", 4))
+    return -1;
+  return strtod(p + strlen(pat), NULL);
+}
+
+static int json_str(const char *line, const char *key, char *out,
+                    size_t cap) {
+  char pat[64];
+  snprintf(pat, sizeof(pat), "\"%s\": \"", key);
+  const char *p = strstr(line, pat);
+  if (!p)
+    return -1;
+  p += strlen(pat);
+  const char *end = strchr(p, '"');
+  if (!end || (size_t)(end - p) >= cap)
+    return -1;
+  memcpy(out, p, (size_t)(end - p));
+  out[end - p] = '\0';
+  return 0;
+}
+
+// Compares against a previous run. Throughput may drop, and syscall
+// counts and peak RSS may grow, by at most threshold percent. Returns
+// the number of regressions.
+static int compare(const char *path, double threshold) {
+  FILE *f = fopen(path, "r");
+  if (!f)
+    die(path);
+  char line[1024];
+  int bad = 0;
+  double slack = threshold / 100.0;
+  while (fgets(line, sizeof(line), f)) {
+    char corpus[16], codec[16], op[16];
+    if (json_str(line, "corpus", corpus, sizeof(corpus)) < 0 ||
+        json_str(line, "codec", codec, sizeof(codec)) < 0 ||
+        json_str(line, "op", op, sizeof(op)) < 0)
+      continue;
+    const struct result *r = NULL;
+    for (size_t i = 0; i < nresults && !r; i++)
+      if (!strcmp(results[i].corpus, corpus) &&
+          !strcmp(results[i].codec, codec) && !strcmp(results[i].op, op))
+        r = &results[i];
+    if (!r)
+      continue;
+    double old_mb = json_num(line, "mb_per_s");
+    double old_fs = json_num(line, "files_per_s");
+    double old_sc = json_num(line, "syscalls");
+    double old_rss = json_num(line, "peak_rss_kb");
+    double mb = rate(r->bytes, r->seconds) / 1e6;
+    double fs = rate(r->files, r->seconds);
+    const char *what = NULL;
+    double was = 0, is = 0;
+    if (old_mb > 0 && mb < old_mb * (1 - slack)) {
+      what = "MB/s", was = old_mb, is = mb;
+    } else if (old_mb <= 0 && old_fs > 0 && fs < old_fs * (1 - slack)) {
+      what = "files/s", was = old_fs, is = fs;
+    } else if (old_sc > 0 && r->syscalls >= 0 &&
+               (double)r->syscalls > old_sc * (1 + slack)) {
+      what = "syscalls", was = old_sc, is = (double)r->syscalls;
+    } else if (old_rss > 0 && (double)r->peak_rss_kb > old_rss * (1 + slack)) {
+      what = "peak RSS KB", was = old_rss, is = (double)r->peak_rss_kb;
+    }
+    if (what) {
+      fprintf(stderr, "REGRESSION %s/%s/%s: %s %.1f -> %.1f\n", corpus,
+              codec, op, what, was, is);
+      bad++;
+    }
+  }
+  fclose(f);
+  return bad;
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "Usage: %s [-d DIR] [-o OUT.json] [-b BASELINE.json] [-t PCT]\n"
+          "          [-s SCALE] [-r RUNS] [-a ARCHIVER]\n"
+          "  -d DIR   work directory, must not exist yet (default: a fresh\n"
+          "           archbench.XXXXXX), removed afterwards\n"
+          "  -o FILE  write the JSON there instead of stdout\n"
+          "  -b FILE  fail if results regress against this earlier output\n"
+          "  -t PCT   allowed regression in percent (default 10)\n"
+          "  -s PCT   corpus size in percent of the default (default 100)\n"
+          "  -r N     timed runs per operation, best counts (default 3)\n"
+          "  -a PATH  archiver binary to benchmark (default ./archiver)\n",
+          prog);
+}
+
+int main(int argc, char **argv) {
+  const char *dir = NULL;
+  const char *out_path = NULL;
+  const char *baseline = NULL;
+  double threshold = 10;
+  int scale = 100;
+  int opt;
+  while ((opt = getopt(argc, argv, "d:o:b:t:s:r:a:h")) != -1) {
+    switch (opt) {
+    case 'd':
+      dir = optarg;
+      break;
+    case 'o':
+      out_path = optarg;
+      break;
+    case 'b':
+      baseline = optarg;
+      break;
+    case 't':
+      threshold = atof(optarg);
+      break;
+    case 's':
+      scale = atoi(optarg);
+      break;
+    case 'r':
+      repeat = atoi(optarg);
+      break;
+    case 'a':
+      archiver = optarg;
+      break;
+    default:
+      usage(argv[0]);
+      return opt == 'h' ? 0 : 1;
+    }
+  }
+  if (scale < 1 || repeat < 1) {
+    usage(argv[0]);
+    return 1;
+  }
+  // The work directory is always one this run created, since all of it
+  // is deleted at the end.
+  char bin[PATH_MAX], tmpl[] = "archbench.XXXXXX";
+  if (!realpath(archiver, bin))
+    die(archiver);
+  archiver = bin;
+  if (dir && mkdir(dir, 0755) < 0) {
+    if (errno == EEXIST)
+      fprintf(stderr, "archbench: %s already exists\n", dir);
+    else
+      perror(dir);
+    return 1;
+  }
+  if (!dir && !(dir = mkdtemp(tmpl)))
+    die("mkdtemp");
+  if (!realpath(dir, work)) {
+    perror(dir);
+    rmdir(dir);
+    return 1;
+  }
+  atexit(remove_work);
+  int home = open(".", O_RDONLY | O_DIRECTORY);
+  if (home < 0)
+    die(".");
+  if (chdir(work) < 0)
+    die(dir);
+
+  for (size_t c = 0; c < sizeof(corpora) / sizeof(*corpora); c++) {
+    const struct corpus *cp = &corpora[c];
+    size_t nfiles;
+    uint64_t bytes = make_corpus(".", cp, scale, &nfiles);
+    char list[64];
+    snprintf(list, sizeof(list), "%s.list", cp->name);
+    for (size_t k = 0; k < sizeof(codecs) / sizeof(*codecs); k++) {
+      char codec_opt[32];
+      snprintf(codec_opt, sizeof(codec_opt), "--codec=%s", codecs[k]);
+      const char *arch = "bench.ar";
+      char *add_argv[] = {(char *)archiver, (char *)arch, "-i",
+                          (char *)cp->name, codec_opt, NULL};
+      char *stat_argv[] = {(char *)archiver, (char *)arch, "-s", NULL};
+      char *extract_argv[] = {(char *)archiver, (char *)arch, "-e", "-T",
+                              list, "-C", "out", NULL};
+      char *compact_argv[] = {(char *)archiver, (char *)arch, "--compact",
+                              NULL};
+
+      measure(cp->name, codecs[k], "add", add_argv, arch, "", nfiles, bytes);
+      measure(cp->name, codecs[k], "stat", stat_argv, arch, NULL, nfiles, 0);
+      mkdir("out", 0755);
+      measure(cp->name, codecs[k], "extract", extract_argv, arch, NULL, nfiles,
+              bytes);
+      // Re-adding replaces every member, leaving all old copies for
+      // compaction.
+      copy_file(arch, "bench.ar.full");
+      measure(cp->name, codecs[k], "readd", add_argv, arch, "bench.ar.full",
+              nfiles, bytes);
+      copy_file(arch, "bench.ar.dup");
+      measure(cp->name, codecs[k], "compact", compact_argv, arch,
+              "bench.ar.dup", nfiles, bytes);
+      unlink("bench.ar.full");
+      unlink("bench.ar.dup");
+      unlink(arch);
+    }
+  }
+  if (fchdir(home) < 0)
+    die("fchdir");
+  close(home);
+  remove_work();
+
+  FILE *out = stdout;
+  if (out_path && !(out = fopen(out_path, "w")))
+    die(out_path);
+  print_json(out);
+  if (out != stdout)
+    fclose(out);
+  if (baseline && compare(baseline, threshold) > 0)
+    return 1;
+  return 0;
+}
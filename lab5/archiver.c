@@ -1,16 +1,41 @@
+#define _GNU_SOURCE
 #include <errno.h>
+#include <dirent.h>
 #include <fcntl.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <time.h>
 #include <unistd.h>
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
 
 #define BUF_SIZE 65536
+#define KERNEL_CHUNK (1u << 30)
+
+// How copy_bytes moves content. auto tries copy_file_range, then
+// sendfile/splice, then the read/write loop; the others are for
+// benchmarking and still fall back to read/write when refused.
+enum copy_engine { COPY_AUTO, COPY_RW, COPY_SPLICE, COPY_CFR };
+
+static enum copy_engine copy_engine = COPY_AUTO;
 
 struct entry_header {
   uint32_t name_len;
@@ -20,132 +45,358 @@ struct entry_header {
   uint32_t gid;
   int64_t mtime;
   uint8_t deleted;
+  uint8_t version; // 0 for the legacy unpacked layout
+  uint8_t codec;
+  uint8_t flags;       // HDR_REF, HDR_CRC, HDR_BLOCKS
+  uint64_t stored_len; // content bytes on disk
+  uint64_t ref_off;    // HDR_REF: header offset of the entry holding the data
+  uint32_t data_crc;   // HDR_CRC: CRC32C of the stored content
+};
+
+// On-disk entry header, little-endian, read and written in one call:
+//    0 u32 magic       4 u8 version    5 u8 deleted    6 u8 codec
+//    7 u8 flags        8 u32 name_len 12 u32 mode     16 u32 uid
+//   20 u32 gid        24 u64 content_len              32 i64 mtime
+//   40 u64 stored_len 48 u64 ref_off  56 u32 data_crc 60 u32 hdr_crc
+// The name follows the header, then stored_len bytes of content. With a
+// codec the content is a sequence of independently decodable blocks.
+// With HDR_BLOCKS the blocks are followed by a table of their offsets in
+// the content, one u64 per BLOCK_SIZE of raw data, for random access.
+// A deduplicated entry (HDR_REF) stores no content: its data is that of
+// the entry at ref_off. With HDR_CRC, hdr_crc covers the header (with the
+// deleted byte and hdr_crc itself zeroed) and the name, and data_crc the
+// stored content.
+#define HDR_MAGIC 0x544e4541u // "AENT"
+#define HDR_VERSION 1
+#define HDR_SIZE 64
+#define HDR_DELETED_OFF 5
+#define HDR_REF 0x1
+#define HDR_CRC 0x2
+#define HDR_BLOCKS 0x4
+
+// Archives written before the packed header store the fields of
+// entry_header back to back in host order, without a magic. Their first
+// field is name_len, which is always below HDR_MAGIC.
+#define LEGACY_HDR_SIZE 33
+#define LEGACY_DELETED_OFF 32
+
+#define MAX_NAME_LEN (1u << 20)
+
+// Central directory written after the last entry on every modification:
+//   [entry 0] ... [entry N-1] [index records] [names] [footer]
+// All index integers are little-endian. An update never overwrites the
+// trailer in use: new entries and the new trailer go after it, and once
+// they are durable the old trailer becomes the content of a deleted
+// filler entry (named FILLER_NAME), so the entries still tile the file.
+#define INDEX_MAGIC 0x58495241u // "ARIX"
+#define INDEX_VERSION 1
+// Records have grown over time: 56 bytes originally, 64 with stored_len,
+// 104 with ref_off and the content digest. Fields past the record size
+// found on disk take their defaults.
+#define INDEX_REC_SIZE 104
+#define INDEX_REC_SIZE_V1 56
+#define FOOTER_SIZE 32
+
+#define IDX_DELETED 0x1u
+#define IDX_LEGACY_HDR 0x2u
+#define IDX_REF 0x4u
+#define IDX_BLOCKS 0x8u
+#define IDX_PENDING 0x80000000u // deleted byte not written yet, not stored
+
+#define FILLER_NAME "/" // never a member name
+
+#define DIGEST_LEN 32
+
+struct index_entry {
+  uint64_t name_hash;
+  uint64_t offset; // of the entry header
+  uint64_t content_len;
+  uint64_t stored_len;
+  int64_t mtime;
+  uint32_t mode;
+  uint32_t uid;
+  uint32_t gid;
+  uint32_t flags; // IDX_* bits, codec in bits 8..15
+  uint32_t name_len;
+  char *name;
+  uint64_t ref_off;
+  uint8_t digest[DIGEST_LEN]; // SHA-256 of the content, zero if not computed
+};
+
+struct archive_index {
+  struct index_entry *entries; // in archive order
+  size_t count;
+  size_t cap;
+  uint64_t data_end; // first byte after the last entry
+  uint64_t file_end; // end of the trailer in use, or of the file
+  uint64_t filler;   // offset of a filler entry whose header is pending
+  int present;       // trailer was found on disk
+  uint32_t *slots;   // open-addressing table, entry position + 1
+  size_t nslots;
+  uint32_t *dslots; // same, keyed by digest, data-holding entries only
+  size_t ndslots;
 };
 
-static ssize_t read_full(int fd, void *buf, size_t count);
 static int write_full(int fd, const void *buf, size_t count);
 
-static int write_header(int fd, const struct entry_header *h) {
-  if (write_full(fd, &h->name_len, sizeof(h->name_len)) < 0)
-    return -1;
-  if (write_full(fd, &h->content_len, sizeof(h->content_len)) < 0)
-    return -1;
-  if (write_full(fd, &h->mode, sizeof(h->mode)) < 0)
-    return -1;
-  if (write_full(fd, &h->uid, sizeof(h->uid)) < 0)
-    return -1;
-  if (write_full(fd, &h->gid, sizeof(h->gid)) < 0)
-    return -1;
-  if (write_full(fd, &h->mtime, sizeof(h->mtime)) < 0)
-    return -1;
-  if (write_full(fd, &h->deleted, sizeof(h->deleted)) < 0)
-    return -1;
-  return 0;
+static void put_u16(uint8_t *p, uint16_t v) {
+  p[0] = (uint8_t)v;
+  p[1] = (uint8_t)(v >> 8);
 }
 
-static int read_header(int fd, struct entry_header *h,
-                       ssize_t *bytes_read_out) {
-  ssize_t total = 0;
-  ssize_t r;
-  r = read_full(fd, &h->name_len, sizeof(h->name_len));
-  if (r == 0) {
-    if (bytes_read_out)
-      *bytes_read_out = 0;
-    return 0;
-  }
-  if (r < 0) {
-    if (bytes_read_out)
-      *bytes_read_out = r;
-    return -1;
-  }
-  total += r;
-  if ((size_t)r < sizeof(h->name_len)) {
-    if (bytes_read_out)
-      *bytes_read_out = total;
-    errno = EINVAL;
-    return -1;
-  }
-  r = read_full(fd, &h->content_len, sizeof(h->content_len));
-  if (r <= 0) {
-    if (bytes_read_out)
-      *bytes_read_out = r;
-    return -1;
-  }
-  total += r;
-  if ((size_t)r < sizeof(h->content_len)) {
-    if (bytes_read_out)
-      *bytes_read_out = total;
-    errno = EINVAL;
-    return -1;
-  }
-  r = read_full(fd, &h->mode, sizeof(h->mode));
-  if (r <= 0) {
-    if (bytes_read_out)
-      *bytes_read_out = r;
-    return -1;
-  }
-  total += r;
-  if ((size_t)r < sizeof(h->mode)) {
-    if (bytes_read_out)
-      *bytes_read_out = total;
-    errno = EINVAL;
-    return -1;
-  }
-  r = read_full(fd, &h->uid, sizeof(h->uid));
-  if (r <= 0) {
-    if (bytes_read_out)
-      *bytes_read_out = r;
-    return -1;
+static void put_u32(uint8_t *p, uint32_t v) {
+  for (int i = 0; i < 4; i++)
+    p[i] = (uint8_t)(v >> (8 * i));
+}
+
+static void put_u64(uint8_t *p, uint64_t v) {
+  for (int i = 0; i < 8; i++)
+    p[i] = (uint8_t)(v >> (8 * i));
+}
+
+static uint16_t get_u16(const uint8_t *p) {
+  return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static uint32_t get_u32(const uint8_t *p) {
+  uint32_t v = 0;
+  for (int i = 3; i >= 0; i--)
+    v = (v << 8) | p[i];
+  return v;
+}
+
+static uint64_t get_u64(const uint8_t *p) {
+  uint64_t v = 0;
+  for (int i = 7; i >= 0; i--)
+    v = (v << 8) | p[i];
+  return v;
+}
+
+// CRC32C (Castagnoli) guards every header and its content. x86-64 CPUs
+// with SSE4.2 compute it with the crc32 instruction; everything else uses
+// slicing-by-8 tables.
+#define CRC32C_POLY 0x82f63b78u
+
+static uint32_t crc32c_table[8][256];
+static int crc32c_hw;
+
+static void crc32c_init(void) {
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t c = i;
+    for (int k = 0; k < 8; k++)
+      c = (c & 1) ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+    crc32c_table[0][i] = c;
   }
-  total += r;
-  if ((size_t)r < sizeof(h->uid)) {
-    if (bytes_read_out)
-      *bytes_read_out = total;
-    errno = EINVAL;
-    return -1;
+  for (uint32_t i = 0; i < 256; i++)
+    for (int k = 1; k < 8; k++)
+      crc32c_table[k][i] = (crc32c_table[k - 1][i] >> 8) ^
+                           crc32c_table[0][crc32c_table[k - 1][i] & 0xff];
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+  crc32c_hw = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t *p, size_t n) {
+  crc = ~crc;
+  while (n >= 8) {
+    uint32_t a = get_u32(p) ^ crc;
+    uint32_t b = get_u32(p + 4);
+    crc = crc32c_table[7][a & 0xff] ^ crc32c_table[6][(a >> 8) & 0xff] ^
+          crc32c_table[5][(a >> 16) & 0xff] ^ crc32c_table[4][a >> 24] ^
+          crc32c_table[3][b & 0xff] ^ crc32c_table[2][(b >> 8) & 0xff] ^
+          crc32c_table[1][(b >> 16) & 0xff] ^ crc32c_table[0][b >> 24];
+    p += 8;
+    n -= 8;
   }
-  r = read_full(fd, &h->gid, sizeof(h->gid));
-  if (r <= 0) {
-    if (bytes_read_out)
-      *bytes_read_out = r;
-    return -1;
+  while (n--)
+    crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+  return ~crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2"))) static uint32_t
+crc32c_sse42(uint32_t crc, const uint8_t *p, size_t n) {
+  uint64_t c = ~crc;
+  for (; n >= 8; p += 8, n -= 8) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    c = _mm_crc32_u64(c, v);
   }
-  total += r;
-  if ((size_t)r < sizeof(h->gid)) {
-    if (bytes_read_out)
-      *bytes_read_out = total;
-    errno = EINVAL;
-    return -1;
+  uint32_t c32 = (uint32_t)c;
+  while (n--)
+    c32 = _mm_crc32_u8(c32, *p++);
+  return ~c32;
+}
+#endif
+
+static uint32_t crc32c(uint32_t crc, const uint8_t *p, size_t n) {
+#if defined(__x86_64__)
+  if (crc32c_hw)
+    return crc32c_sse42(crc, p, n);
+#endif
+  return crc32c_sw(crc, p, n);
+}
+
+static uint32_t gf2_times(const uint32_t *mat, uint32_t vec) {
+  uint32_t sum = 0;
+  for (; vec; vec >>= 1, mat++)
+    if (vec & 1)
+      sum ^= *mat;
+  return sum;
+}
+
+static void gf2_square(uint32_t *sq, const uint32_t *mat) {
+  for (int n = 0; n < 32; n++)
+    sq[n] = gf2_times(mat, mat[n]);
+}
+
+// CRC of A followed by B, given crc(A), crc(B) and len(B), as in zlib's
+// crc32_combine(). Lets workers checksum blocks independently.
+static uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2, uint64_t len2) {
+  if (len2 == 0)
+    return crc1;
+  uint32_t even[32];
+  uint32_t odd[32];
+  odd[0] = CRC32C_POLY;
+  for (int n = 1; n < 32; n++)
+    odd[n] = 1u << (n - 1);
+  gf2_square(even, odd);
+  gf2_square(odd, even);
+  for (;;) {
+    gf2_square(even, odd);
+    if (len2 & 1)
+      crc1 = gf2_times(even, crc1);
+    len2 >>= 1;
+    if (!len2)
+      break;
+    gf2_square(odd, even);
+    if (len2 & 1)
+      crc1 = gf2_times(odd, crc1);
+    len2 >>= 1;
+    if (!len2)
+      break;
   }
-  r = read_full(fd, &h->mtime, sizeof(h->mtime));
-  if (r <= 0) {
-    if (bytes_read_out)
-      *bytes_read_out = r;
+  return crc1 ^ crc2;
+}
+
+// Checksums len bytes of fd starting at off.
+static int crc_range(int fd, uint64_t off, uint64_t len, uint32_t *crc_out) {
+  size_t cap = 16 * BUF_SIZE;
+  uint8_t *buf = (uint8_t *)malloc(cap);
+  if (!buf) {
+    perror("malloc");
     return -1;
   }
-  total += r;
-  if ((size_t)r < sizeof(h->mtime)) {
-    if (bytes_read_out)
-      *bytes_read_out = total;
-    errno = EINVAL;
-    return -1;
+  uint32_t crc = 0;
+  int rc = 0;
+  while (len > 0) {
+    size_t chunk = len > cap ? cap : (size_t)len;
+    ssize_t r = pread(fd, buf, chunk, (off_t)off);
+    if (r <= 0) {
+      if (r < 0 && errno == EINTR)
+        continue;
+      rc = -1;
+      break;
+    }
+    crc = crc32c(crc, buf, (size_t)r);
+    off += (uint64_t)r;
+    len -= (uint64_t)r;
   }
-  r = read_full(fd, &h->deleted, sizeof(h->deleted));
-  if (r <= 0) {
-    if (bytes_read_out)
-      *bytes_read_out = r;
-    return -1;
+  free(buf);
+  *crc_out = crc;
+  return rc;
+}
+
+static uint32_t header_crc(const uint8_t *p, const char *name,
+                           size_t name_len) {
+  uint8_t tmp[HDR_SIZE];
+  memcpy(tmp, p, HDR_SIZE);
+  tmp[HDR_DELETED_OFF] = 0;
+  memset(tmp + 60, 0, 4);
+  return crc32c(crc32c(0, tmp, HDR_SIZE), (const uint8_t *)name, name_len);
+}
+
+static void encode_header(uint8_t *p, const struct entry_header *h,
+                          const char *name) {
+  memset(p, 0, HDR_SIZE);
+  put_u32(p, HDR_MAGIC);
+  p[4] = HDR_VERSION;
+  p[5] = h->deleted;
+  p[6] = h->codec;
+  p[7] = h->flags | HDR_CRC;
+  put_u32(p + 8, h->name_len);
+  put_u32(p + 12, h->mode);
+  put_u32(p + 16, h->uid);
+  put_u32(p + 20, h->gid);
+  put_u64(p + 24, h->content_len);
+  put_u64(p + 32, (uint64_t)h->mtime);
+  put_u64(p + 40, h->stored_len);
+  put_u64(p + 48, h->ref_off);
+  put_u32(p + 56, h->data_crc);
+  put_u32(p + 60, header_crc(p, name, h->name_len));
+}
+
+// Parses a packed or legacy header from `avail` bytes at p. Returns the
+// header size, 0 if more bytes are needed, -1 if it is not a header.
+static int decode_header(const uint8_t *p, size_t avail,
+                         struct entry_header *h) {
+  if (avail < 4)
+    return 0;
+  memset(h, 0, sizeof(*h));
+  if (get_u32(p) == HDR_MAGIC) {
+    if (avail < HDR_SIZE)
+      return 0;
+    if (p[4] == 0 || p[4] > HDR_VERSION)
+      return -1;
+    h->version = p[4];
+    h->deleted = p[5];
+    h->codec = p[6];
+    h->flags = p[7];
+    h->name_len = get_u32(p + 8);
+    h->mode = get_u32(p + 12);
+    h->uid = get_u32(p + 16);
+    h->gid = get_u32(p + 20);
+    h->content_len = get_u64(p + 24);
+    h->mtime = (int64_t)get_u64(p + 32);
+    h->stored_len = h->codec ? get_u64(p + 40) : h->content_len;
+    if (h->flags & HDR_REF) {
+      h->stored_len = 0;
+      h->ref_off = get_u64(p + 48);
+    }
+    h->data_crc = get_u32(p + 56);
+    return HDR_SIZE;
   }
-  total += r;
-  if ((size_t)r < sizeof(h->deleted)) {
-    if (bytes_read_out)
-      *bytes_read_out = total;
-    errno = EINVAL;
-    return -1;
+  if (avail < LEGACY_HDR_SIZE)
+    return 0;
+  memcpy(&h->name_len, p, 4);
+  memcpy(&h->content_len, p + 4, 8);
+  memcpy(&h->mode, p + 12, 4);
+  memcpy(&h->uid, p + 16, 4);
+  memcpy(&h->gid, p + 20, 4);
+  memcpy(&h->mtime, p + 24, 8);
+  h->deleted = p[32];
+  h->stored_len = h->content_len;
+  return LEGACY_HDR_SIZE;
+}
+
+// Writes a packed header followed by the name with a single write.
+static int write_header(int fd, const struct entry_header *h,
+                        const char *name) {
+  uint8_t stackbuf[HDR_SIZE + 256];
+  uint8_t *buf = stackbuf;
+  size_t len = HDR_SIZE + h->name_len;
+  if (len > sizeof(stackbuf)) {
+    buf = (uint8_t *)malloc(len);
+    if (!buf)
+      return -1;
   }
-  if (bytes_read_out)
-    *bytes_read_out = total;
-  return 1;
+  encode_header(buf, h, name);
+  memcpy(buf + HDR_SIZE, name, h->name_len);
+  int rc = write_full(fd, buf, len);
+  if (buf != stackbuf)
+    free(buf);
+  return rc;
 }
 
 static ssize_t read_full(int fd, void *buf, size_t count) {
@@ -178,251 +429,2409 @@ static int write_full(int fd, const void *buf, size_t count) {
   return 0;
 }
 
-static int copy_bytes(int src_fd, int dst_fd, uint64_t bytes) {
+static int copy_rw(int src_fd, int dst_fd, uint64_t *remaining) {
   char buf[BUF_SIZE];
-  uint64_t remaining = bytes;
-  while (remaining > 0) {
-    size_t chunk = remaining > BUF_SIZE ? BUF_SIZE : (size_t)remaining;
+  while (*remaining > 0) {
+    size_t chunk = *remaining > BUF_SIZE ? BUF_SIZE : (size_t)*remaining;
     ssize_t r = read_full(src_fd, buf, chunk);
     if (r <= 0)
       return -1;
     if (write_full(dst_fd, buf, (size_t)r) < 0)
       return -1;
-    remaining -= (uint64_t)r;
+    *remaining -= (uint64_t)r;
   }
   return 0;
 }
 
-static int list_archive(const char *arch_path) {
-  int fd = open(arch_path, O_RDONLY);
-  if (fd < 0) {
-    if (errno == ENOENT) {
-      return 0;
+// errno values meaning "this path does not work for these fds".
+static int kernel_copy_refused(int err) {
+  return err == EINVAL || err == EXDEV || err == ENOSYS ||
+         err == EOPNOTSUPP || err == EBADF || err == ESPIPE;
+}
+
+// The kernel copy helpers return 0 when done, 1 when the kernel refused
+// before copying anything (caller falls back) and -1 on error.
+static int copy_cfr(int src_fd, int dst_fd, uint64_t *remaining) {
+  int copied = 0;
+  while (*remaining > 0) {
+    size_t chunk =
+        *remaining > KERNEL_CHUNK ? KERNEL_CHUNK : (size_t)*remaining;
+    ssize_t n = copy_file_range(src_fd, NULL, dst_fd, NULL, chunk, 0);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return (!copied && kernel_copy_refused(errno)) ? 1 : -1;
     }
-    perror("open");
+    if (n == 0)
+      return -1;
+    copied = 1;
+    *remaining -= (uint64_t)n;
+  }
+  return 0;
+}
+
+static int is_pipe(int fd) {
+  struct stat st;
+  return fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode);
+}
+
+static int copy_splice(int src_fd, int dst_fd, uint64_t *remaining) {
+  int use_splice = is_pipe(src_fd) || is_pipe(dst_fd);
+  int copied = 0;
+  while (*remaining > 0) {
+    size_t chunk =
+        *remaining > KERNEL_CHUNK ? KERNEL_CHUNK : (size_t)*remaining;
+    ssize_t n = use_splice ? splice(src_fd, NULL, dst_fd, NULL, chunk,
+                                    SPLICE_F_MOVE | SPLICE_F_MORE)
+                           : sendfile(dst_fd, src_fd, NULL, chunk);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return (!copied && kernel_copy_refused(errno)) ? 1 : -1;
+    }
+    if (n == 0)
+      return -1;
+    copied = 1;
+    *remaining -= (uint64_t)n;
+  }
+  return 0;
+}
+
+// Copies `bytes` from the current offset of src_fd to the current offset
+// of dst_fd; both offsets advance as with read/write.
+static int copy_bytes(int src_fd, int dst_fd, uint64_t bytes) {
+  uint64_t remaining = bytes;
+  int rc = 1;
+  if (remaining == 0)
+    return 0;
+  if (copy_engine == COPY_AUTO || copy_engine == COPY_CFR)
+    rc = copy_cfr(src_fd, dst_fd, &remaining);
+  if (rc == 1 && (copy_engine == COPY_AUTO || copy_engine == COPY_SPLICE))
+    rc = copy_splice(src_fd, dst_fd, &remaining);
+  if (rc == 1)
+    rc = copy_rw(src_fd, dst_fd, &remaining);
+  return rc;
+}
+
+// Per-entry codecs. Content is cut into BLOCK_SIZE pieces, each stored as
+//   u32 raw_len, u32 frame_len (FRAME_RAW set when stored uncompressed),
+//   frame_len bytes
+// so extraction streams one block at a time in bounded memory. LZ4 blocks
+// use the standard LZ4 block format: liblz4 is used when available and
+// the built-in coder below otherwise, so any build can read them.
+#define CODEC_NONE 0
+#define CODEC_LZ4 1
+#define CODEC_ZSTD 2
+#define CODEC_DEFLATE 3
+
+#define BLOCK_SIZE (128 * 1024)
+#define FRAME_HDR 8
+#define FRAME_RAW 0x80000000u
+#define BLOCK_BOUND (BLOCK_SIZE + BLOCK_SIZE / 255 + 64)
+
+static int codec = CODEC_NONE; // for new entries
+static int dedup = 0;          // store repeated content as references
+
+static const char *codec_name(int c) {
+  switch (c) {
+  case CODEC_NONE:
+    return "none";
+  case CODEC_LZ4:
+    return "lz4";
+  case CODEC_ZSTD:
+    return "zstd";
+  case CODEC_DEFLATE:
+    return "deflate";
+  }
+  return "unknown";
+}
+
+static int codec_available(int c) {
+  switch (c) {
+  case CODEC_NONE:
+  case CODEC_LZ4:
     return 1;
+  case CODEC_ZSTD:
+#ifdef HAVE_ZSTD
+    return 1;
+#else
+    return 0;
+#endif
+  case CODEC_DEFLATE:
+#ifdef HAVE_ZLIB
+    return 1;
+#else
+    return 0;
+#endif
   }
-  struct entry_header hdr;
-  while (1) {
-    ssize_t r = 0;
-    int rh = read_header(fd, &hdr, &r);
-    if (rh == 0)
-      break;
-    if (rh < 0) {
-      perror("read header");
-      close(fd);
-      return 1;
+  return 0;
+}
+
+#ifndef HAVE_LZ4
+#define LZ4_HASH_LOG 14
+#define LZ4_MIN_MATCH 4
+#define LZ4_LAST_LITERALS 5
+#define LZ4_MF_LIMIT 12
+
+static uint32_t read_u32(const uint8_t *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static uint32_t lz4_hash(uint32_t v) {
+  return (v * 2654435761u) >> (32 - LZ4_HASH_LOG);
+}
+
+static uint8_t *lz4_put_len(uint8_t *op, size_t len) {
+  while (len >= 255) {
+    *op++ = 255;
+    len -= 255;
+  }
+  *op++ = (uint8_t)len;
+  return op;
+}
+
+// Emits one sequence; returns NULL if it does not fit before dst_end.
+static uint8_t *lz4_put_seq(uint8_t *op, const uint8_t *dst_end,
+                            const uint8_t *lit, size_t lit_len,
+                            size_t offset, size_t match_len) {
+  size_t ml = match_len ? match_len - LZ4_MIN_MATCH : 0;
+  size_t need = 1 + lit_len / 255 + 1 + lit_len + 2 + ml / 255 + 1;
+  if ((size_t)(dst_end - op) < need)
+    return NULL;
+  uint8_t *token = op++;
+  *token = (uint8_t)((lit_len >= 15 ? 15 : lit_len) << 4);
+  if (lit_len >= 15)
+    op = lz4_put_len(op, lit_len - 15);
+  memcpy(op, lit, lit_len);
+  op += lit_len;
+  if (!match_len)
+    return op;
+  *op++ = (uint8_t)offset;
+  *op++ = (uint8_t)(offset >> 8);
+  *token |= (uint8_t)(ml >= 15 ? 15 : ml);
+  if (ml >= 15)
+    op = lz4_put_len(op, ml - 15);
+  return op;
+}
+
+// Greedy single-probe LZ4 block compressor. Returns the compressed size,
+// or 0 if the output does not fit in cap.
+static size_t lz4_compress_block(const uint8_t *src, size_t n, uint8_t *dst,
+                                 size_t cap) {
+  uint32_t table[1 << LZ4_HASH_LOG];
+  memset(table, 0, sizeof(table));
+  uint8_t *op = dst;
+  const uint8_t *dst_end = dst + cap;
+  size_t anchor = 0;
+  if (n > LZ4_MF_LIMIT) {
+    size_t mf_limit = n - LZ4_MF_LIMIT;
+    size_t match_limit = n - LZ4_LAST_LITERALS;
+    size_t ip = 1;
+    while (ip < mf_limit) {
+      uint32_t seq = read_u32(src + ip);
+      uint32_t h = lz4_hash(seq);
+      size_t ref = table[h];
+      table[h] = (uint32_t)ip;
+      if (ref >= ip || ip - ref > 65535 || read_u32(src + ref) != seq) {
+        // Skip faster through data that does not compress.
+        ip += 1 + ((ip - anchor) >> 6);
+        continue;
+      }
+      size_t len = LZ4_MIN_MATCH;
+      while (ip + len < match_limit && src[ref + len] == src[ip + len])
+        len++;
+      while (ip > anchor && ref > 0 && src[ip - 1] == src[ref - 1]) {
+        ip--;
+        ref--;
+        len++;
+      }
+      op = lz4_put_seq(op, dst_end, src + anchor, ip - anchor, ip - ref, len);
+      if (!op)
+        return 0;
+      ip += len;
+      anchor = ip;
     }
+  }
+  op = lz4_put_seq(op, dst_end, src + anchor, n - anchor, 0, 0);
+  return op ? (size_t)(op - dst) : 0;
+}
 
-    if (hdr.name_len == 0 || hdr.name_len > (1u << 20)) {
-      fprintf(stderr, "corrupt archive (name_len)\n");
-      close(fd);
-      return 1;
+static ssize_t lz4_decompress_block(const uint8_t *src, size_t n,
+                                    uint8_t *dst, size_t cap) {
+  size_t ip = 0;
+  size_t op = 0;
+  while (ip < n) {
+    uint8_t token = src[ip++];
+    size_t lit = token >> 4;
+    if (lit == 15) {
+      uint8_t b;
+      do {
+        if (ip >= n)
+          return -1;
+        b = src[ip++];
+        lit += b;
+      } while (b == 255);
+    }
+    if (lit > n - ip || lit > cap - op)
+      return -1;
+    memcpy(dst + op, src + ip, lit);
+    ip += lit;
+    op += lit;
+    if (ip == n)
+      break; // the last sequence has no match
+    if (n - ip < 2)
+      return -1;
+    size_t offset = (size_t)src[ip] | ((size_t)src[ip + 1] << 8);
+    ip += 2;
+    if (offset == 0 || offset > op)
+      return -1;
+    size_t len = token & 15;
+    if (len == 15) {
+      uint8_t b;
+      do {
+        if (ip >= n)
+          return -1;
+        b = src[ip++];
+        len += b;
+      } while (b == 255);
+    }
+    len += LZ4_MIN_MATCH;
+    if (len > cap - op)
+      return -1;
+    // Matches may overlap their own output.
+    for (size_t i = 0; i < len; i++)
+      dst[op + i] = dst[op - offset + i];
+    op += len;
+  }
+  return (ssize_t)op;
+}
+#endif
+
+// Returns the compressed size, or 0 when the block should be stored raw.
+static size_t compress_block(int c, const uint8_t *src, size_t n,
+                             uint8_t *dst, size_t cap) {
+  size_t out = 0;
+  switch (c) {
+  case CODEC_LZ4:
+#ifdef HAVE_LZ4
+  {
+    int r = LZ4_compress_default((const char *)src, (char *)dst, (int)n,
+                                 (int)cap);
+    out = r > 0 ? (size_t)r : 0;
+  }
+#else
+    out = lz4_compress_block(src, n, dst, cap);
+#endif
+    break;
+#ifdef HAVE_ZSTD
+  case CODEC_ZSTD: {
+    size_t r = ZSTD_compress(dst, cap, src, n, 3);
+    out = ZSTD_isError(r) ? 0 : r;
+    break;
+  }
+#endif
+#ifdef HAVE_ZLIB
+  case CODEC_DEFLATE: {
+    uLongf dlen = (uLongf)cap;
+    out = compress2(dst, &dlen, src, (uLong)n, 6) == Z_OK ? (size_t)dlen : 0;
+    break;
+  }
+#endif
+  }
+  return out < n ? out : 0;
+}
+
+static ssize_t decompress_block(int c, const uint8_t *src, size_t n,
+                                uint8_t *dst, size_t cap) {
+  switch (c) {
+  case CODEC_LZ4:
+#ifdef HAVE_LZ4
+  {
+    int r = LZ4_decompress_safe((const char *)src, (char *)dst, (int)n,
+                                (int)cap);
+    return r < 0 ? -1 : r;
+  }
+#else
+    return lz4_decompress_block(src, n, dst, cap);
+#endif
+#ifdef HAVE_ZSTD
+  case CODEC_ZSTD: {
+    size_t r = ZSTD_decompress(dst, cap, src, n);
+    return ZSTD_isError(r) ? -1 : (ssize_t)r;
+  }
+#endif
+#ifdef HAVE_ZLIB
+  case CODEC_DEFLATE: {
+    uLongf dlen = (uLongf)cap;
+    if (uncompress(dst, &dlen, src, (uLong)n) != Z_OK)
+      return -1;
+    return (ssize_t)dlen;
+  }
+#endif
+  }
+  return -1;
+}
+
+// Builds the frame for one block in out (FRAME_HDR + BLOCK_BOUND bytes)
+// and returns its length.
+static size_t encode_frame(int c, const uint8_t *raw, size_t n,
+                           uint8_t *out) {
+  size_t clen = compress_block(c, raw, n, out + FRAME_HDR, BLOCK_BOUND);
+  put_u32(out, (uint32_t)n);
+  if (clen) {
+    put_u32(out + 4, (uint32_t)clen);
+  } else {
+    put_u32(out + 4, (uint32_t)n | FRAME_RAW);
+    memcpy(out + FRAME_HDR, raw, n);
+    clen = n;
+  }
+  return FRAME_HDR + clen;
+}
+
+// Worker pool for -j. The main thread reads blocks into a ring of jobs,
+// workers encode them in any order, and the main thread writes finished
+// frames strictly in ring order. The ring bounds memory to two jobs per
+// worker. Frames are encoded by the same encode_frame() as the serial
+// path, so the output is byte-identical. A job with codec JOB_CRC_ONLY is
+// only checksummed, for members stored as they are.
+enum { JOB_FREE, JOB_QUEUED, JOB_DONE };
+enum { JOB_CRC_ONLY = -1 };
+
+struct block_job {
+  uint8_t *raw;
+  uint8_t *frame;
+  size_t raw_len;
+  size_t frame_len;
+  uint32_t crc; // of the frame, or of raw for JOB_CRC_ONLY
+  int codec;
+  int state;
+};
+
+static struct {
+  pthread_mutex_t mtx;
+  pthread_cond_t work; // a job was queued or the pool is stopping
+  pthread_cond_t done; // a job finished
+  struct block_job *ring;
+  size_t nring;
+  uint64_t head;  // next job the reader fills
+  uint64_t claim; // next job a worker takes
+  uint64_t tail;  // next job the writer emits
+  int stop;
+  int nthreads;
+  pthread_t *threads;
+} pool = {.mtx = PTHREAD_MUTEX_INITIALIZER,
+          .work = PTHREAD_COND_INITIALIZER,
+          .done = PTHREAD_COND_INITIALIZER};
+
+static void *pool_worker(void *arg) {
+  (void)arg;
+  pthread_mutex_lock(&pool.mtx);
+  for (;;) {
+    while (pool.claim == pool.head && !pool.stop)
+      pthread_cond_wait(&pool.work, &pool.mtx);
+    if (pool.claim == pool.head)
+      break;
+    struct block_job *job = &pool.ring[pool.claim % pool.nring];
+    pool.claim++;
+    pthread_mutex_unlock(&pool.mtx);
+    if (job->codec == JOB_CRC_ONLY) {
+      job->crc = crc32c(0, job->raw, job->raw_len);
+    } else {
+      job->frame_len = encode_frame(job->codec, job->raw, job->raw_len,
+                                    job->frame);
+      job->crc = crc32c(0, job->frame, job->frame_len);
     }
-    char *name = (char *)malloc(hdr.name_len + 1);
-    if (!name) {
+    pthread_mutex_lock(&pool.mtx);
+    job->state = JOB_DONE;
+    pthread_cond_broadcast(&pool.done);
+  }
+  pthread_mutex_unlock(&pool.mtx);
+  return NULL;
+}
+
+static int pool_start(int nthreads) {
+  pool.nring = (size_t)nthreads * 2;
+  pool.ring = (struct block_job *)calloc(pool.nring, sizeof(*pool.ring));
+  pool.threads = (pthread_t *)calloc((size_t)nthreads, sizeof(pthread_t));
+  if (!pool.ring || !pool.threads) {
+    perror("calloc");
+    return -1;
+  }
+  for (size_t i = 0; i < pool.nring; i++) {
+    pool.ring[i].raw = (uint8_t *)malloc(BLOCK_SIZE);
+    pool.ring[i].frame = (uint8_t *)malloc(FRAME_HDR + BLOCK_BOUND);
+    if (!pool.ring[i].raw || !pool.ring[i].frame) {
       perror("malloc");
-      close(fd);
-      return 1;
+      return -1;
     }
-    if (read_full(fd, name, hdr.name_len) < 0) {
-      perror("read name");
-      free(name);
-      close(fd);
-      return 1;
+  }
+  for (int i = 0; i < nthreads; i++) {
+    if (pthread_create(&pool.threads[i], NULL, pool_worker, NULL) != 0) {
+      perror("pthread_create");
+      return -1;
     }
-    name[hdr.name_len] = '\0';
+    pool.nthreads++;
+  }
+  return 0;
+}
 
-    if (!hdr.deleted) {
-      printf("%s\t%lu bytes\tmode %o\tuid %u\tgid %u\tmtime %ld\n", name,
-             (unsigned long)hdr.content_len, hdr.mode, hdr.uid, hdr.gid,
-             (long)hdr.mtime);
+static void pool_stop(void) {
+  pthread_mutex_lock(&pool.mtx);
+  pool.stop = 1;
+  pthread_cond_broadcast(&pool.work);
+  pthread_mutex_unlock(&pool.mtx);
+  for (int i = 0; i < pool.nthreads; i++)
+    pthread_join(pool.threads[i], NULL);
+  for (size_t i = 0; pool.ring && i < pool.nring; i++) {
+    free(pool.ring[i].raw);
+    free(pool.ring[i].frame);
+  }
+  free(pool.ring);
+  free(pool.threads);
+}
+
+// Number of BLOCK_SIZE blocks, and so of frames, for raw_len bytes.
+static uint64_t block_count(uint64_t raw_len) {
+  return (raw_len + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
+
+// Length of the frames alone: HDR_BLOCKS content ends with the table.
+static uint64_t frames_len(const struct entry_header *h) {
+  if (!(h->flags & HDR_BLOCKS))
+    return h->stored_len;
+  uint64_t table = 8 * block_count(h->content_len);
+  return h->stored_len > table ? h->stored_len - table : 0;
+}
+
+static uint8_t *block_table_alloc(uint64_t raw_len) {
+  uint8_t *table = (uint8_t *)malloc((size_t)(8 * block_count(raw_len)) + 1);
+  if (!table)
+    perror("malloc");
+  return table;
+}
+
+static int block_table_write(int dst_fd, const uint8_t *table,
+                             size_t nframes, uint64_t *stored,
+                             uint32_t *crc) {
+  if (write_full(dst_fd, table, 8 * nframes) < 0)
+    return -1;
+  *crc = crc32c(*crc, table, 8 * nframes);
+  *stored += 8 * nframes;
+  return 0;
+}
+
+// Parallel compress_stream(). Must only be called from the main thread.
+static int compress_stream_pool(int src_fd, int dst_fd, int c,
+                                uint64_t raw_len, uint64_t *stored_len,
+                                uint32_t *crc_out) {
+  uint8_t *table = block_table_alloc(raw_len);
+  if (!table)
+    return -1;
+  uint64_t remaining = raw_len;
+  uint64_t stored = 0;
+  uint32_t crc = 0;
+  size_t nframes = 0;
+  int rc = 0;
+  pthread_mutex_lock(&pool.mtx);
+  while (pool.tail < pool.head || (remaining > 0 && rc == 0)) {
+    while (rc == 0 && remaining > 0 && pool.head - pool.tail < pool.nring) {
+      struct block_job *job = &pool.ring[pool.head % pool.nring];
+      size_t chunk = remaining > BLOCK_SIZE ? BLOCK_SIZE : (size_t)remaining;
+      // Free jobs are touched by no one else: read without the lock.
+      pthread_mutex_unlock(&pool.mtx);
+      ssize_t r = read_full(src_fd, job->raw, chunk);
+      pthread_mutex_lock(&pool.mtx);
+      if (r != (ssize_t)chunk) {
+        rc = -1;
+        break;
+      }
+      job->raw_len = chunk;
+      job->codec = c;
+      job->state = JOB_QUEUED;
+      pool.head++;
+      remaining -= chunk;
+      pthread_cond_signal(&pool.work);
     }
+    if (pool.tail == pool.head)
+      break;
+    struct block_job *job = &pool.ring[pool.tail % pool.nring];
+    while (job->state != JOB_DONE)
+      pthread_cond_wait(&pool.done, &pool.mtx);
+    if (rc == 0) {
+      pthread_mutex_unlock(&pool.mtx);
+      if (write_full(dst_fd, job->frame, job->frame_len) < 0)
+        rc = -1;
+      pthread_mutex_lock(&pool.mtx);
+      put_u64(table + 8 * nframes++, stored);
+      stored += job->frame_len;
+      crc = crc32c_combine(crc, job->crc, job->frame_len);
+    }
+    // After an error the remaining jobs are drained without writing.
+    job->state = JOB_FREE;
+    pool.tail++;
+  }
+  pthread_mutex_unlock(&pool.mtx);
+  if (rc == 0)
+    rc = block_table_write(dst_fd, table, nframes, &stored, &crc);
+  free(table);
+  *stored_len = stored;
+  *crc_out = crc;
+  return rc;
+}
 
-    if (lseek(fd, (off_t)hdr.content_len, SEEK_CUR) == (off_t)-1) {
-      if (copy_bytes(fd, -1, hdr.content_len) < 0) {
-        free(name);
-        close(fd);
-        return 1;
+// Parallel crc_range(): workers checksum BLOCK_SIZE blocks and the main
+// thread joins them in order. Must only be called from the main thread.
+static int crc_range_pool(int fd, uint64_t off, uint64_t len,
+                          uint32_t *crc_out) {
+  uint32_t crc = 0;
+  int rc = 0;
+  pthread_mutex_lock(&pool.mtx);
+  while (pool.tail < pool.head || (len > 0 && rc == 0)) {
+    while (rc == 0 && len > 0 && pool.head - pool.tail < pool.nring) {
+      struct block_job *job = &pool.ring[pool.head % pool.nring];
+      size_t chunk = len > BLOCK_SIZE ? BLOCK_SIZE : (size_t)len;
+      pthread_mutex_unlock(&pool.mtx);
+      size_t got = 0;
+      while (got < chunk) {
+        ssize_t r = pread(fd, job->raw + got, chunk - got, (off_t)(off + got));
+        if (r < 0 && errno == EINTR)
+          continue;
+        if (r <= 0)
+          break;
+        got += (size_t)r;
+      }
+      pthread_mutex_lock(&pool.mtx);
+      if (got != chunk) {
+        rc = -1;
+        break;
+      }
+      job->raw_len = chunk;
+      job->codec = JOB_CRC_ONLY;
+      job->state = JOB_QUEUED;
+      pool.head++;
+      off += chunk;
+      len -= chunk;
+      pthread_cond_signal(&pool.work);
+    }
+    if (pool.tail == pool.head)
+      break;
+    struct block_job *job = &pool.ring[pool.tail % pool.nring];
+    while (job->state != JOB_DONE)
+      pthread_cond_wait(&pool.done, &pool.mtx);
+    crc = crc32c_combine(crc, job->crc, job->raw_len);
+    job->state = JOB_FREE;
+    pool.tail++;
+  }
+  pthread_mutex_unlock(&pool.mtx);
+  *crc_out = crc;
+  return rc;
+}
+
+// Reads raw_len bytes from src_fd and writes them to dst_fd as frames.
+// Reports the stored length and its CRC32C.
+static int compress_stream(int src_fd, int dst_fd, int c, uint64_t raw_len,
+                           uint64_t *stored_len, uint32_t *crc_out) {
+  if (pool.nthreads > 0 && raw_len > BLOCK_SIZE)
+    return compress_stream_pool(src_fd, dst_fd, c, raw_len, stored_len,
+                                crc_out);
+  uint8_t *raw = (uint8_t *)malloc(BLOCK_SIZE);
+  uint8_t *out = (uint8_t *)malloc(FRAME_HDR + BLOCK_BOUND);
+  uint8_t *table = block_table_alloc(raw_len);
+  if (!raw || !out || !table) {
+    perror("malloc");
+    free(raw);
+    free(out);
+    free(table);
+    return -1;
+  }
+  uint64_t remaining = raw_len;
+  uint64_t stored = 0;
+  uint32_t crc = 0;
+  size_t nframes = 0;
+  int rc = 0;
+  while (remaining > 0) {
+    size_t chunk = remaining > BLOCK_SIZE ? BLOCK_SIZE : (size_t)remaining;
+    ssize_t r = read_full(src_fd, raw, chunk);
+    if (r != (ssize_t)chunk) {
+      rc = -1;
+      break;
+    }
+    size_t flen = encode_frame(c, raw, chunk, out);
+    if (write_full(dst_fd, out, flen) < 0) {
+      rc = -1;
+      break;
+    }
+    put_u64(table + 8 * nframes++, stored);
+    stored += flen;
+    crc = crc32c(crc, out, flen);
+    remaining -= chunk;
+  }
+  if (rc == 0)
+    rc = block_table_write(dst_fd, table, nframes, &stored, &crc);
+  free(raw);
+  free(out);
+  free(table);
+  *stored_len = stored;
+  *crc_out = crc;
+  return rc;
+}
+
+// Decodes stored_len bytes of frames from src_fd into raw_len bytes.
+static int decompress_stream(int src_fd, int dst_fd, int c,
+                             uint64_t stored_len, uint64_t raw_len) {
+  if (!codec_available(c)) {
+    fprintf(stderr, "codec %s is not built into this archiver\n",
+            codec_name(c));
+    return -1;
+  }
+  uint8_t *in = (uint8_t *)malloc(BLOCK_BOUND);
+  uint8_t *raw = (uint8_t *)malloc(BLOCK_SIZE);
+  if (!in || !raw) {
+    perror("malloc");
+    free(in);
+    free(raw);
+    return -1;
+  }
+  uint64_t left = stored_len;
+  uint64_t produced = 0;
+  int rc = 0;
+  while (left > 0) {
+    uint8_t fh[FRAME_HDR];
+    if (left < FRAME_HDR || read_full(src_fd, fh, FRAME_HDR) != FRAME_HDR) {
+      rc = -1;
+      break;
+    }
+    uint32_t rlen = get_u32(fh);
+    uint32_t flen = get_u32(fh + 4) & ~FRAME_RAW;
+    int is_raw = (get_u32(fh + 4) & FRAME_RAW) != 0;
+    if (rlen > BLOCK_SIZE || flen > BLOCK_BOUND ||
+        flen > left - FRAME_HDR || (is_raw && flen != rlen) ||
+        read_full(src_fd, in, flen) != (ssize_t)flen) {
+      rc = -1;
+      break;
+    }
+    const uint8_t *data = in;
+    if (!is_raw) {
+      ssize_t d = decompress_block(c, in, flen, raw, BLOCK_SIZE);
+      if (d != (ssize_t)rlen) {
+        rc = -1;
+        break;
       }
+      data = raw;
+    }
+    if (write_full(dst_fd, data, rlen) < 0) {
+      rc = -1;
+      break;
     }
-    free(name);
+    left -= FRAME_HDR + flen;
+    produced += rlen;
+  }
+  if (rc == 0 && produced != raw_len)
+    rc = -1;
+  free(in);
+  free(raw);
+  return rc;
+}
+
+// decompress_stream for frames that are already mapped; stored frames are
+// written straight out of src.
+static int decompress_mem(const uint8_t *src, int dst_fd, int c,
+                          uint64_t stored_len, uint64_t raw_len) {
+  if (!codec_available(c)) {
+    fprintf(stderr, "codec %s is not built into this archiver\n",
+            codec_name(c));
+    return -1;
+  }
+  uint8_t *raw = (uint8_t *)malloc(BLOCK_SIZE);
+  if (!raw) {
+    perror("malloc");
+    return -1;
+  }
+  uint64_t left = stored_len;
+  uint64_t produced = 0;
+  int rc = 0;
+  while (left > 0) {
+    if (left < FRAME_HDR) {
+      rc = -1;
+      break;
+    }
+    uint32_t rlen = get_u32(src);
+    uint32_t flen = get_u32(src + 4) & ~FRAME_RAW;
+    int is_raw = (get_u32(src + 4) & FRAME_RAW) != 0;
+    if (rlen > BLOCK_SIZE || flen > BLOCK_BOUND ||
+        flen > left - FRAME_HDR || (is_raw && flen != rlen)) {
+      rc = -1;
+      break;
+    }
+    const uint8_t *data = src + FRAME_HDR;
+    if (!is_raw) {
+      if (decompress_block(c, data, flen, raw, BLOCK_SIZE) != (ssize_t)rlen) {
+        rc = -1;
+        break;
+      }
+      data = raw;
+    }
+    if (write_full(dst_fd, data, rlen) < 0) {
+      rc = -1;
+      break;
+    }
+    src += FRAME_HDR + flen;
+    left -= FRAME_HDR + flen;
+    produced += rlen;
+  }
+  if (rc == 0 && produced != raw_len)
+    rc = -1;
+  free(raw);
+  return rc;
+}
+
+// Maps the first len bytes of fd read-only. NULL means the caller should
+// fall back to read(); that includes empty files.
+static const uint8_t *map_archive(int fd, uint64_t len) {
+  if (len == 0 || len != (uint64_t)(size_t)len)
+    return NULL;
+  void *p = mmap(NULL, (size_t)len, PROT_READ, MAP_SHARED, fd, 0);
+  return p == MAP_FAILED ? NULL : (const uint8_t *)p;
+}
+
+// madvise wants page-aligned ranges.
+static void advise_range(const uint8_t *map, uint64_t off, uint64_t len,
+                         int advice) {
+  uint64_t page = (uint64_t)sysconf(_SC_PAGESIZE);
+  uint64_t start = off & ~(page - 1);
+  madvise((void *)(map + start), (size_t)(off + len - start), advice);
+}
+
+// Walks entry headers out of a user-space buffer, so a scan costs one
+// read per BUF_SIZE of metadata instead of several syscalls per entry.
+// Content that does not fit in the buffer is skipped by offset. When the
+// archive can be mapped, buf is the mapping and a scan makes no syscalls.
+struct scan_buf {
+  int fd;
+  uint8_t *buf;
+  size_t cap;
+  size_t pos;   // first unconsumed byte in buf
+  size_t len;   // bytes valid in buf
+  uint64_t off; // archive offset of buf[pos]
+  uint64_t end; // stop scanning here
+  int mapped;
+};
+
+static int scan_init(struct scan_buf *sb, int fd, uint64_t end) {
+  memset(sb, 0, sizeof(*sb));
+  sb->fd = fd;
+  sb->end = end;
+  const uint8_t *map = map_archive(fd, end);
+  if (map) {
+    advise_range(map, 0, end, MADV_SEQUENTIAL);
+    sb->buf = (uint8_t *)map;
+    sb->cap = sb->len = (size_t)end;
+    sb->mapped = 1;
+    return 0;
+  }
+  sb->cap = BUF_SIZE;
+  sb->buf = (uint8_t *)malloc(sb->cap);
+  if (!sb->buf) {
+    perror("malloc");
+    return -1;
+  }
+  return 0;
+}
+
+static void scan_free(struct scan_buf *sb) {
+  if (sb->mapped)
+    munmap(sb->buf, sb->cap);
+  else
+    free(sb->buf);
+}
+
+// Makes at least `need` bytes available at buf[pos] unless the scan range
+// ends first. Returns the number of bytes available, or -1.
+static ssize_t scan_fill(struct scan_buf *sb, size_t need) {
+  size_t have = sb->len - sb->pos;
+  if (have >= need || sb->mapped)
+    return (ssize_t)have;
+  if (need > sb->cap) {
+    size_t ncap = sb->cap;
+    while (ncap < need)
+      ncap *= 2;
+    uint8_t *n = (uint8_t *)malloc(ncap);
+    if (!n) {
+      perror("malloc");
+      return -1;
+    }
+    memcpy(n, sb->buf + sb->pos, have);
+    free(sb->buf);
+    sb->buf = n;
+    sb->cap = ncap;
+  } else {
+    memmove(sb->buf, sb->buf + sb->pos, have);
+  }
+  sb->pos = 0;
+  sb->len = have;
+  while (sb->len < need) {
+    uint64_t at = sb->off + sb->len;
+    if (at >= sb->end)
+      break;
+    size_t want = sb->cap - sb->len;
+    if ((uint64_t)want > sb->end - at)
+      want = (size_t)(sb->end - at);
+    ssize_t r = pread(sb->fd, sb->buf + sb->len, want, (off_t)at);
+    if (r < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("read archive");
+      return -1;
+    }
+    if (r == 0)
+      break;
+    sb->len += (size_t)r;
+  }
+  return (ssize_t)sb->len;
+}
+
+// Parses the next entry. On success *name points into the scan buffer and
+// stays valid until the next call; *entry_off is the header offset.
+// Returns 1 on success, 0 at end of archive, -1 on error (already reported).
+static int scan_next(struct scan_buf *sb, struct entry_header *h,
+                     const char **name, uint64_t *entry_off) {
+  ssize_t avail = scan_fill(sb, HDR_SIZE);
+  if (avail < 0)
+    return -1;
+  if (avail == 0)
+    return 0;
+  int hs = decode_header(sb->buf + sb->pos, (size_t)avail, h);
+  if (hs <= 0) {
+    fprintf(stderr, "corrupt archive\n");
+    return -1;
+  }
+  if (h->name_len == 0 || h->name_len > MAX_NAME_LEN) {
+    fprintf(stderr, "corrupt archive (name_len)\n");
+    return -1;
+  }
+  avail = scan_fill(sb, (size_t)hs + h->name_len);
+  if (avail < 0)
+    return -1;
+  if ((size_t)avail < (size_t)hs + h->name_len) {
+    fprintf(stderr, "corrupt archive (name)\n");
+    return -1;
+  }
+  *name = (const char *)sb->buf + sb->pos + hs;
+  *entry_off = sb->off;
+
+  uint64_t advance = (uint64_t)hs + h->name_len + h->stored_len;
+  if (advance <= (uint64_t)avail) {
+    sb->pos += (size_t)advance;
+  } else {
+    // Drop the buffer; the name bytes stay in place until the next fill.
+    sb->pos = sb->len = 0;
+  }
+  sb->off += advance;
+  if (sb->off > sb->end) {
+    fprintf(stderr, "corrupt archive (truncated entry)\n");
+    return -1;
+  }
+  return 1;
+}
+
+// SHA-256 names member content for deduplication.
+
+struct sha256 {
+  uint32_t h[8];
+  uint64_t len;
+  uint8_t buf[64];
+  size_t fill;
+};
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+static uint32_t ror32(uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+
+static void sha256_block(struct sha256 *c, const uint8_t *p) {
+  uint32_t w[64];
+  for (int i = 0; i < 16; i++)
+    w[i] = (uint32_t)p[4 * i] << 24 | (uint32_t)p[4 * i + 1] << 16 |
+           (uint32_t)p[4 * i + 2] << 8 | p[4 * i + 3];
+  for (int i = 16; i < 64; i++) {
+    uint32_t s0 = ror32(w[i - 15], 7) ^ ror32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+    uint32_t s1 = ror32(w[i - 2], 17) ^ ror32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+    w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+  }
+  uint32_t a = c->h[0], b = c->h[1], cc = c->h[2], d = c->h[3];
+  uint32_t e = c->h[4], f = c->h[5], g = c->h[6], h = c->h[7];
+  for (int i = 0; i < 64; i++) {
+    uint32_t t1 = h + (ror32(e, 6) ^ ror32(e, 11) ^ ror32(e, 25)) +
+                  ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+    uint32_t t2 = (ror32(a, 2) ^ ror32(a, 13) ^ ror32(a, 22)) +
+                  ((a & b) ^ (a & cc) ^ (b & cc));
+    h = g;
+    g = f;
+    f = e;
+    e = d + t1;
+    d = cc;
+    cc = b;
+    b = a;
+    a = t1 + t2;
+  }
+  c->h[0] += a;
+  c->h[1] += b;
+  c->h[2] += cc;
+  c->h[3] += d;
+  c->h[4] += e;
+  c->h[5] += f;
+  c->h[6] += g;
+  c->h[7] += h;
+}
+
+static void sha256_init(struct sha256 *c) {
+  static const uint32_t iv[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372,
+                                 0xa54ff53a, 0x510e527f, 0x9b05688c,
+                                 0x1f83d9ab, 0x5be0cd19};
+  memcpy(c->h, iv, sizeof(iv));
+  c->len = 0;
+  c->fill = 0;
+}
+
+static void sha256_update(struct sha256 *c, const uint8_t *p, size_t n) {
+  c->len += n;
+  if (c->fill) {
+    size_t take = 64 - c->fill < n ? 64 - c->fill : n;
+    memcpy(c->buf + c->fill, p, take);
+    c->fill += take;
+    p += take;
+    n -= take;
+    if (c->fill < 64)
+      return;
+    sha256_block(c, c->buf);
+    c->fill = 0;
+  }
+  for (; n >= 64; p += 64, n -= 64)
+    sha256_block(c, p);
+  memcpy(c->buf, p, n);
+  c->fill = n;
+}
+
+static void sha256_final(struct sha256 *c, uint8_t out[DIGEST_LEN]) {
+  uint64_t bits = c->len * 8;
+  uint8_t pad[72] = {0x80};
+  size_t padlen = (c->fill < 56 ? 56 : 120) - c->fill;
+  for (int i = 0; i < 8; i++)
+    pad[padlen + i] = (uint8_t)(bits >> (56 - 8 * i));
+  sha256_update(c, pad, padlen + 8);
+  for (int i = 0; i < 8; i++) {
+    out[4 * i] = (uint8_t)(c->h[i] >> 24);
+    out[4 * i + 1] = (uint8_t)(c->h[i] >> 16);
+    out[4 * i + 2] = (uint8_t)(c->h[i] >> 8);
+    out[4 * i + 3] = (uint8_t)c->h[i];
+  }
+}
+
+// Hashes the first len bytes of fd; the file offset is not moved.
+static int hash_file(int fd, uint64_t len, uint8_t out[DIGEST_LEN]) {
+  struct sha256 c;
+  sha256_init(&c);
+  uint8_t *buf = (uint8_t *)malloc(BUF_SIZE);
+  if (!buf) {
+    perror("malloc");
+    return -1;
+  }
+  uint64_t off = 0;
+  int rc = 0;
+  while (off < len) {
+    size_t chunk = len - off > BUF_SIZE ? BUF_SIZE : (size_t)(len - off);
+    ssize_t r = pread(fd, buf, chunk, (off_t)off);
+    if (r <= 0) {
+      if (r < 0 && errno == EINTR)
+        continue;
+      rc = -1;
+      break;
+    }
+    sha256_update(&c, buf, (size_t)r);
+    off += (uint64_t)r;
+  }
+  free(buf);
+  sha256_final(&c, out);
+  return rc;
+}
+
+// FNV-1a
+static uint64_t name_hash(const char *s, size_t len) {
+  uint64_t h = 1469598103934665603ull;
+  for (size_t i = 0; i < len; i++) {
+    h ^= (uint8_t)s[i];
+    h *= 1099511628211ull;
+  }
+  return h;
+}
+
+static void index_init(struct archive_index *idx) {
+  memset(idx, 0, sizeof(*idx));
+  idx->filler = UINT64_MAX;
+}
+
+static void index_free(struct archive_index *idx) {
+  for (size_t i = 0; i < idx->count; i++)
+    free(idx->entries[i].name);
+  free(idx->entries);
+  free(idx->slots);
+  free(idx->dslots);
+  index_init(idx);
+}
+
+static struct index_entry *index_add(struct archive_index *idx,
+                                     const char *name, uint64_t offset,
+                                     const struct entry_header *h) {
+  if (idx->count == idx->cap) {
+    size_t ncap = idx->cap ? idx->cap * 2 : 64;
+    struct index_entry *n = (struct index_entry *)realloc(
+        idx->entries, ncap * sizeof(*idx->entries));
+    if (!n) {
+      perror("realloc");
+      return NULL;
+    }
+    idx->entries = n;
+    idx->cap = ncap;
+  }
+  struct index_entry *e = &idx->entries[idx->count];
+  memset(e, 0, sizeof(*e));
+  e->name_len = h->name_len;
+  e->name = (char *)malloc(h->name_len + 1);
+  if (!e->name) {
+    perror("malloc");
+    return NULL;
+  }
+  memcpy(e->name, name, h->name_len);
+  e->name[h->name_len] = '\0';
+  e->name_hash = name_hash(name, h->name_len);
+  e->offset = offset;
+  e->content_len = h->content_len;
+  e->stored_len = h->stored_len;
+  e->mtime = h->mtime;
+  e->mode = h->mode;
+  e->uid = h->uid;
+  e->gid = h->gid;
+  e->flags = h->deleted ? IDX_DELETED : 0;
+  if (h->version == 0)
+    e->flags |= IDX_LEGACY_HDR;
+  e->flags |= (uint32_t)h->codec << 8;
+  if (h->flags & HDR_REF) {
+    e->flags |= IDX_REF;
+    e->ref_off = h->ref_off;
+  }
+  if (h->flags & HDR_BLOCKS)
+    e->flags |= IDX_BLOCKS;
+  idx->count++;
+  if (idx->slots && idx->count * 2 <= idx->nslots) {
+    size_t slot = (size_t)e->name_hash & (idx->nslots - 1);
+    while (idx->slots[slot])
+      slot = (slot + 1) & (idx->nslots - 1);
+    idx->slots[slot] = (uint32_t)idx->count;
+  } else {
+    // Rebuilt at twice the size by the next lookup.
+    free(idx->slots);
+    idx->slots = NULL;
+    idx->nslots = 0;
+  }
+  return e;
+}
+
+static int index_build_slots(struct archive_index *idx) {
+  size_t n = 16;
+  while (n < idx->count * 2)
+    n <<= 1;
+  uint32_t *slots = (uint32_t *)calloc(n, sizeof(*slots));
+  if (!slots) {
+    perror("calloc");
+    return -1;
+  }
+  for (size_t i = 0; i < idx->count; i++) {
+    size_t s = (size_t)idx->entries[i].name_hash & (n - 1);
+    while (slots[s])
+      s = (s + 1) & (n - 1);
+    slots[s] = (uint32_t)(i + 1);
+  }
+  free(idx->slots);
+  idx->slots = slots;
+  idx->nslots = n;
+  return 0;
+}
+
+// Returns the newest live entry called `name`, or NULL.
+static struct index_entry *index_lookup(struct archive_index *idx,
+                                        const char *name) {
+  if (idx->count == 0)
+    return NULL;
+  if (!idx->slots && index_build_slots(idx) < 0)
+    return NULL;
+  size_t len = strlen(name);
+  uint64_t h = name_hash(name, len);
+  struct index_entry *best = NULL;
+  size_t s = (size_t)h & (idx->nslots - 1);
+  while (idx->slots[s]) {
+    struct index_entry *e = &idx->entries[idx->slots[s] - 1];
+    if (e->name_hash == h && e->name_len == len &&
+        !(e->flags & IDX_DELETED) && memcmp(e->name, name, len) == 0 &&
+        (!best || e->offset > best->offset))
+      best = e;
+    s = (s + 1) & (idx->nslots - 1);
+  }
+  return best;
+}
+
+static int digest_is_set(const uint8_t *d) {
+  for (int i = 0; i < DIGEST_LEN; i++)
+    if (d[i])
+      return 1;
+  return 0;
+}
+
+static void dslot_insert(struct archive_index *idx, size_t pos) {
+  size_t mask = idx->ndslots - 1;
+  size_t s = (size_t)get_u64(idx->entries[pos].digest) & mask;
+  while (idx->dslots[s])
+    s = (s + 1) & mask;
+  idx->dslots[s] = (uint32_t)(pos + 1);
+}
+
+static int index_build_dslots(struct archive_index *idx) {
+  size_t n = 16;
+  while (n < idx->count * 2)
+    n <<= 1;
+  free(idx->dslots);
+  idx->dslots = (uint32_t *)calloc(n, sizeof(*idx->dslots));
+  if (!idx->dslots) {
+    perror("calloc");
+    idx->ndslots = 0;
+    return -1;
+  }
+  idx->ndslots = n;
+  for (size_t i = 0; i < idx->count; i++) {
+    const struct index_entry *e = &idx->entries[i];
+    if (!(e->flags & IDX_REF) && digest_is_set(e->digest))
+      dslot_insert(idx, i);
+  }
+  return 0;
+}
+
+// Records the content digest of e, making it a dedup target.
+static int index_set_digest(struct archive_index *idx, struct index_entry *e,
+                            const uint8_t *digest) {
+  memcpy(e->digest, digest, DIGEST_LEN);
+  if (!idx->dslots || (e->flags & IDX_REF) || !digest_is_set(digest))
+    return 0;
+  if (idx->count * 2 > idx->ndslots)
+    return index_build_dslots(idx);
+  dslot_insert(idx, (size_t)(e - idx->entries));
+  return 0;
+}
+
+// Finds an entry holding data with this digest and length, live or not:
+// the bytes of a deleted entry stay in place until --compact.
+static struct index_entry *index_find_digest(struct archive_index *idx,
+                                             const uint8_t *digest,
+                                             uint64_t content_len) {
+  if (!idx->dslots && index_build_dslots(idx) < 0)
+    return NULL;
+  size_t mask = idx->ndslots - 1;
+  size_t s = (size_t)get_u64(digest) & mask;
+  while (idx->dslots[s]) {
+    struct index_entry *e = &idx->entries[idx->dslots[s] - 1];
+    if (e->content_len == content_len &&
+        memcmp(e->digest, digest, DIGEST_LEN) == 0)
+      return e;
+    s = (s + 1) & mask;
+  }
+  return NULL;
+}
+
+// Entries are kept in archive order, so offsets are increasing.
+static struct index_entry *index_find_offset(struct archive_index *idx,
+                                             uint64_t offset) {
+  size_t lo = 0;
+  size_t hi = idx->count;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (idx->entries[mid].offset < offset)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if (lo < idx->count && idx->entries[lo].offset == offset)
+    return &idx->entries[lo];
+  return NULL;
+}
+
+struct footer {
+  uint16_t rec_size;
+  uint64_t count;
+  uint64_t index_off;
+  uint64_t names_len;
+};
+
+// Decodes the footer at p, which ends at offset `end` of the file, and
+// checks that the trailer it describes ends there too.
+static int parse_footer(const uint8_t *p, uint64_t end, struct footer *f) {
+  if (get_u32(p) != INDEX_MAGIC || get_u16(p + 4) != INDEX_VERSION)
+    return 0;
+  f->rec_size = get_u16(p + 6);
+  f->count = get_u64(p + 8);
+  f->index_off = get_u64(p + 16);
+  f->names_len = get_u64(p + 24);
+  return f->rec_size >= INDEX_REC_SIZE_V1 && f->count <= end / f->rec_size &&
+         f->index_off <= end && f->names_len <= UINT32_MAX &&
+         f->index_off + f->count * f->rec_size + f->names_len + FOOTER_SIZE ==
+             end;
+}
+
+// An update that died before its trailer was durable leaves a torn tail
+// after the trailer it started from. That one is found by searching
+// backwards for a footer that checks out at its own position, and *end
+// is set to the end of it.
+static int find_footer(int fd, uint64_t size, uint64_t *end,
+                       struct footer *f) {
+  uint8_t *buf = (uint8_t *)malloc(BUF_SIZE + FOOTER_SIZE);
+  if (!buf)
+    return 0;
+  int found = 0;
+  uint64_t hi = size; // the window is [lo, hi)
+  while (!found && hi >= FOOTER_SIZE) {
+    uint64_t lo = hi > BUF_SIZE + FOOTER_SIZE ? hi - BUF_SIZE - FOOTER_SIZE : 0;
+    if (pread(fd, buf, (size_t)(hi - lo), (off_t)lo) != (ssize_t)(hi - lo))
+      break;
+    for (size_t q = (size_t)(hi - lo - FOOTER_SIZE) + 1; !found && q-- > 0;)
+      if (parse_footer(buf + q, lo + q + FOOTER_SIZE, f)) {
+        *end = lo + q + FOOTER_SIZE;
+        found = 1;
+      }
+    if (lo == 0)
+      break;
+    hi = lo + FOOTER_SIZE - 1; // footers that straddle the windows
+  }
+  free(buf);
+  return found;
+}
+
+// Loads the trailer index if there is one. Archives written before the
+// index existed have no trailer: data_end is then the file size and
+// callers fall back to a linear scan.
+static int load_index(int fd, struct archive_index *idx) {
+  index_init(idx);
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    perror("fstat");
+    return -1;
+  }
+  uint64_t size = (uint64_t)st.st_size;
+  idx->data_end = idx->file_end = size;
+  if (size < FOOTER_SIZE)
+    return 0;
+
+  uint8_t foot[FOOTER_SIZE];
+  struct footer f;
+  if ((pread(fd, foot, FOOTER_SIZE, (off_t)(size - FOOTER_SIZE)) !=
+           FOOTER_SIZE ||
+       !parse_footer(foot, size, &f)) &&
+      !find_footer(fd, size, &idx->file_end, &f))
+    return 0;
+  uint16_t rec_size = f.rec_size;
+  uint64_t count = f.count;
+  uint64_t index_off = f.index_off;
+  uint64_t names_len = f.names_len;
+
+  size_t blob_len = (size_t)(count * rec_size + names_len);
+  uint8_t *blob = (uint8_t *)malloc(blob_len ? blob_len : 1);
+  if (!blob) {
+    perror("malloc");
+    return -1;
+  }
+  if (pread(fd, blob, blob_len, (off_t)index_off) != (ssize_t)blob_len) {
+    perror("read index");
+    free(blob);
+    return -1;
+  }
+  const uint8_t *names = blob + count * rec_size;
+  for (uint64_t i = 0; i < count; i++) {
+    const uint8_t *p = blob + i * rec_size;
+    struct entry_header h;
+    memset(&h, 0, sizeof(h));
+    uint32_t name_off = get_u32(p + 52);
+    h.name_len = get_u32(p + 48);
+    if (name_off > names_len || h.name_len > names_len - name_off) {
+      fprintf(stderr, "corrupt archive index\n");
+      free(blob);
+      index_free(idx);
+      return -1;
+    }
+    h.content_len = get_u64(p + 16);
+    h.mtime = (int64_t)get_u64(p + 24);
+    h.mode = get_u32(p + 32);
+    h.uid = get_u32(p + 36);
+    h.gid = get_u32(p + 40);
+    uint32_t flags = get_u32(p + 44);
+    h.deleted = (flags & IDX_DELETED) ? 1 : 0;
+    h.version = (flags & IDX_LEGACY_HDR) ? 0 : HDR_VERSION;
+    h.codec = (uint8_t)(flags >> 8);
+    h.stored_len = rec_size >= 64 ? get_u64(p + 56) : h.content_len;
+    if (flags & IDX_REF) {
+      h.flags = HDR_REF;
+      h.ref_off = get_u64(p + 64);
+    }
+    if (flags & IDX_BLOCKS)
+      h.flags |= HDR_BLOCKS;
+    struct index_entry *e =
+        index_add(idx, (const char *)names + name_off, get_u64(p + 8), &h);
+    if (!e) {
+      free(blob);
+      index_free(idx);
+      return -1;
+    }
+    if (rec_size >= 104 && index_set_digest(idx, e, p + 72) < 0) {
+      free(blob);
+      index_free(idx);
+      return -1;
+    }
+  }
+  free(blob);
+  idx->data_end = index_off;
+  idx->present = 1;
+  return 0;
+}
+
+// Appends the index trailer at the current position of fd, which must be
+// idx->data_end.
+static int write_index(int fd, const struct archive_index *idx) {
+  uint64_t names_len = 0;
+  for (size_t i = 0; i < idx->count; i++)
+    names_len += idx->entries[i].name_len;
+  size_t len = idx->count * INDEX_REC_SIZE + (size_t)names_len + FOOTER_SIZE;
+  uint8_t *buf = (uint8_t *)malloc(len);
+  if (!buf) {
+    perror("malloc");
+    return -1;
+  }
+  uint8_t *names = buf + idx->count * INDEX_REC_SIZE;
+  uint64_t name_off = 0;
+  for (size_t i = 0; i < idx->count; i++) {
+    const struct index_entry *e = &idx->entries[i];
+    uint8_t *p = buf + i * INDEX_REC_SIZE;
+    put_u64(p, e->name_hash);
+    put_u64(p + 8, e->offset);
+    put_u64(p + 16, e->content_len);
+    put_u64(p + 24, (uint64_t)e->mtime);
+    put_u32(p + 32, e->mode);
+    put_u32(p + 36, e->uid);
+    put_u32(p + 40, e->gid);
+    put_u32(p + 44, e->flags & ~IDX_PENDING);
+    put_u32(p + 48, e->name_len);
+    put_u32(p + 52, (uint32_t)name_off);
+    put_u64(p + 56, e->stored_len);
+    put_u64(p + 64, e->ref_off);
+    memcpy(p + 72, e->digest, DIGEST_LEN);
+    memcpy(names + name_off, e->name, e->name_len);
+    name_off += e->name_len;
+  }
+  uint8_t *foot = buf + len - FOOTER_SIZE;
+  put_u32(foot, INDEX_MAGIC);
+  put_u16(foot + 4, INDEX_VERSION);
+  put_u16(foot + 6, INDEX_REC_SIZE);
+  put_u64(foot + 8, idx->count);
+  put_u64(foot + 16, idx->data_end);
+  put_u64(foot + 24, names_len);
+  int rc = write_full(fd, buf, len);
+  free(buf);
+  return rc;
+}
+
+static void print_entry(const char *name, const struct entry_header *hdr) {
+  printf("%.*s\t%lu bytes\tmode %o\tuid %u\tgid %u\tmtime %ld",
+         (int)hdr->name_len, name, (unsigned long)hdr->content_len, hdr->mode,
+         hdr->uid, hdr->gid, (long)hdr->mtime);
+  if (hdr->flags & HDR_REF)
+    printf("\tdedup");
+  else if (hdr->codec != CODEC_NONE)
+    printf("\t%s %lu stored", codec_name(hdr->codec),
+           (unsigned long)hdr->stored_len);
+  printf("\n");
+}
+
+struct dedup_stats {
+  uint64_t logical; // content bytes of live members
+  uint64_t unique;  // content bytes actually stored for them
+  size_t refs;
+};
+
+// For linear scans: the data behind a reference is counted only if the
+// entry holding it is live.
+static void dedup_account(struct dedup_stats *ds,
+                          const struct entry_header *hdr) {
+  ds->logical += hdr->content_len;
+  if (hdr->flags & HDR_REF)
+    ds->refs++;
+  else
+    ds->unique += hdr->content_len;
+}
+
+// With an index every holder needed by a live member is counted once,
+// including deleted ones that still carry data for references.
+static int dedup_account_index(struct dedup_stats *ds,
+                               struct archive_index *idx) {
+  uint8_t *needed = (uint8_t *)calloc(idx->count + 1, 1);
+  if (!needed) {
+    perror("calloc");
+    return -1;
+  }
+  for (size_t i = 0; i < idx->count; i++) {
+    const struct index_entry *e = &idx->entries[i];
+    if (e->flags & IDX_DELETED)
+      continue;
+    ds->logical += e->content_len;
+    size_t holder = i;
+    if (e->flags & IDX_REF) {
+      ds->refs++;
+      const struct index_entry *t = index_find_offset(idx, e->ref_off);
+      if (!t)
+        continue;
+      holder = (size_t)(t - idx->entries);
+    }
+    if (!needed[holder]) {
+      needed[holder] = 1;
+      ds->unique += idx->entries[holder].content_len;
+    }
+  }
+  free(needed);
+  return 0;
+}
+
+static void print_dedup_stats(const struct dedup_stats *ds) {
+  if (ds->refs == 0)
+    return;
+  printf("dedup: %zu references, %lu bytes saved, ratio %.2f\n", ds->refs,
+         (unsigned long)(ds->logical - ds->unique),
+         ds->unique ? (double)ds->logical / (double)ds->unique : 1.0);
+}
+
+static void entry_to_header(const struct index_entry *e,
+                            struct entry_header *h) {
+  memset(h, 0, sizeof(*h));
+  h->name_len = e->name_len;
+  h->content_len = e->content_len;
+  h->mode = e->mode;
+  h->uid = e->uid;
+  h->gid = e->gid;
+  h->mtime = e->mtime;
+  h->deleted = (e->flags & IDX_DELETED) ? 1 : 0;
+  h->version = (e->flags & IDX_LEGACY_HDR) ? 0 : HDR_VERSION;
+  h->codec = (uint8_t)(e->flags >> 8);
+  h->stored_len = e->stored_len;
+  h->flags = (e->flags & IDX_REF) ? HDR_REF : 0;
+  if (e->flags & IDX_BLOCKS)
+    h->flags |= HDR_BLOCKS;
+  h->ref_off = e->ref_off;
+}
+
+static uint64_t entry_data_off(const struct index_entry *e) {
+  uint64_t hs = (e->flags & IDX_LEGACY_HDR) ? LEGACY_HDR_SIZE : HDR_SIZE;
+  return e->offset + hs + e->name_len;
+}
+
+// Fills hdr with the metadata of e and the encoding of the entry that
+// actually holds its bytes, which differs for deduplicated entries.
+static int resolve_data(struct archive_index *idx,
+                        const struct index_entry *e, struct entry_header *hdr,
+                        uint64_t *data_off) {
+  entry_to_header(e, hdr);
+  if (!(e->flags & IDX_REF)) {
+    *data_off = entry_data_off(e);
+    return 0;
+  }
+  const struct index_entry *t = index_find_offset(idx, e->ref_off);
+  if (!t || (t->flags & IDX_REF) || t->content_len != e->content_len) {
+    fprintf(stderr, "corrupt archive (bad reference from %s)\n", e->name);
+    return -1;
+  }
+  hdr->codec = (uint8_t)(t->flags >> 8);
+  hdr->stored_len = t->stored_len;
+  if (t->flags & IDX_BLOCKS)
+    hdr->flags |= HDR_BLOCKS;
+  *data_off = entry_data_off(t);
+  return 0;
+}
+
+// Opens the archive and takes a whole-file lock: F_RDLCK for readers,
+// F_WRLCK for writers. Open file description locks belong to the
+// descriptor, not the process, and are dropped when it is closed. A
+// writer may have renamed a compacted copy over the path while we waited,
+// leaving us locked on a dead file: then reopen and try again. On failure
+// errno is set for the caller's message.
+static int open_locked(const char *arch_path, int flags, short type) {
+  for (;;) {
+    int fd = open(arch_path, flags, 0644);
+    if (fd < 0)
+      return -1;
+    struct flock fl;
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = type;
+    fl.l_whence = SEEK_SET;
+    int rc;
+    while ((rc = fcntl(fd, F_OFD_SETLKW, &fl)) < 0 && errno == EINTR)
+      ;
+    if (rc < 0 && errno == EINVAL) // kernels before 3.15
+      while ((rc = fcntl(fd, F_SETLKW, &fl)) < 0 && errno == EINTR)
+        ;
+    if (rc < 0) {
+      int err = errno;
+      close(fd);
+      errno = err;
+      return -1;
+    }
+    struct stat held, now;
+    if (fstat(fd, &held) == 0 && stat(arch_path, &now) == 0 &&
+        held.st_dev == now.st_dev && held.st_ino == now.st_ino)
+      return fd;
+    close(fd);
+  }
+}
+
+static int list_archive(const char *arch_path) {
+  int fd = open_locked(arch_path, O_RDONLY, F_RDLCK);
+  if (fd < 0) {
+    if (errno == ENOENT) {
+      return 0;
+    }
+    perror("open");
+    return 1;
+  }
+  struct archive_index idx;
+  if (load_index(fd, &idx) < 0) {
+    close(fd);
+    return 1;
+  }
+  struct entry_header hdr;
+  struct dedup_stats ds = {0, 0, 0};
+  if (idx.present) {
+    for (size_t i = 0; i < idx.count; i++) {
+      entry_to_header(&idx.entries[i], &hdr);
+      if (!hdr.deleted)
+        print_entry(idx.entries[i].name, &hdr);
+    }
+    if (dedup_account_index(&ds, &idx) == 0)
+      print_dedup_stats(&ds);
+    index_free(&idx);
+    close(fd);
+    return 0;
+  }
+
+  struct scan_buf sb;
+  if (scan_init(&sb, fd, idx.data_end) < 0) {
+    index_free(&idx);
+    close(fd);
+    return 1;
+  }
+  index_free(&idx);
+  int rc = 0;
+  while (1) {
+    const char *name;
+    uint64_t entry_off;
+    int rs = scan_next(&sb, &hdr, &name, &entry_off);
+    if (rs == 0)
+      break;
+    if (rs < 0) {
+      rc = 1;
+      break;
+    }
+    if (!hdr.deleted) {
+      print_entry(name, &hdr);
+      dedup_account(&ds, &hdr);
+    }
+  }
+  if (rc == 0)
+    print_dedup_stats(&ds);
+  scan_free(&sb);
+  close(fd);
+  return rc;
+}
+
+// Builds the index of an archive that has no trailer by walking it.
+static int scan_index(int fd, struct archive_index *idx) {
+  struct scan_buf sb;
+  if (scan_init(&sb, fd, idx->data_end) < 0)
+    return -1;
+  struct entry_header hdr;
+  while (1) {
+    const char *name;
+    uint64_t entry_off;
+    int rs = scan_next(&sb, &hdr, &name, &entry_off);
+    if (rs == 0)
+      break;
+    if (rs < 0 || !index_add(idx, name, entry_off, &hdr)) {
+      scan_free(&sb);
+      return -1;
+    }
+  }
+  idx->data_end = sb.off;
+  scan_free(&sb);
+  return 0;
+}
+
+// Opens a read-only snapshot: the index is loaded under a shared lock,
+// which is then released. Writers only append past the snapshot's
+// data_end, flip deleted bytes, or replace the file by rename, so the
+// bytes the snapshot points at stay valid while they work.
+static int open_snapshot(const char *arch_path, struct archive_index *idx) {
+  int fd = open_locked(arch_path, O_RDONLY, F_RDLCK);
+  if (fd < 0) {
+    perror("open");
+    return -1;
+  }
+  if (load_index(fd, idx) < 0) {
+    close(fd);
+    return -1;
+  }
+  if (!idx->present && scan_index(fd, idx) < 0) {
+    index_free(idx);
+    close(fd);
+    return -1;
+  }
+  struct flock fl;
+  memset(&fl, 0, sizeof(fl));
+  fl.l_type = F_UNLCK;
+  fl.l_whence = SEEK_SET;
+  if (fcntl(fd, F_OFD_SETLK, &fl) < 0)
+    fcntl(fd, F_SETLK, &fl);
+  return fd;
+}
+
+static int is_filler(const struct index_entry *e) {
+  return (e->flags & IDX_DELETED) && e->name_len == 1 &&
+         e->name[0] == FILLER_NAME[0];
+}
+
+// Writes the header of filler entry f over the start of the old trailer.
+static int write_filler(int fd, const struct index_entry *f) {
+  struct entry_header h;
+  entry_to_header(f, &h);
+  h.version = HDR_VERSION;
+  if (crc_range(fd, entry_data_off(f), f->stored_len, &h.data_crc) < 0 ||
+      lseek(fd, (off_t)f->offset, SEEK_SET) == (off_t)-1 ||
+      write_header(fd, &h, FILLER_NAME) < 0) {
+    perror("write filler");
+    return -1;
+  }
+  return 0;
+}
+
+// The exclusive lock is held until fd is closed. flags may add O_CREAT.
+static int open_for_update(const char *arch_path, int flags,
+                           struct archive_index *idx) {
+  int fd = open_locked(arch_path, O_RDWR | flags, F_WRLCK);
+  if (fd < 0) {
+    perror("open archive");
+    return -1;
+  }
+  if (load_index(fd, idx) < 0) {
+    close(fd);
+    return -1;
+  }
+  if (!idx->present && scan_index(fd, idx) < 0) {
+    index_free(idx);
+    close(fd);
+    return -1;
+  }
+  // The torn tail of an update that died before its trailer was durable
+  // can go at once. One that stopped after may not have written its
+  // filler header; the newest filler is the only candidate.
+  struct stat st;
+  if (idx->present && fstat(fd, &st) == 0 &&
+      (uint64_t)st.st_size > idx->file_end &&
+      ftruncate(fd, (off_t)idx->file_end) < 0) {
+    perror("ftruncate");
+    index_free(idx);
+    close(fd);
+    return -1;
+  }
+  for (size_t i = idx->count; i-- > 0;) {
+    const struct index_entry *e = &idx->entries[i];
+    if (!is_filler(e))
+      continue;
+    uint8_t buf[HDR_SIZE];
+    struct entry_header h;
+    if (pread(fd, buf, HDR_SIZE, (off_t)e->offset) != HDR_SIZE ||
+        decode_header(buf, HDR_SIZE, &h) != HDR_SIZE)
+      write_filler(fd, e);
+    break;
+  }
+  return fd;
+}
+
+// Moves data_end past the trailer on disk, and whatever a crashed update
+// left after it, by covering them with a deleted filler entry in the
+// index. Its header is written by commit_index() once nothing needs the
+// old trailer any more. It needs room for a header and a one-byte name.
+static int skip_old_trailer(struct archive_index *idx) {
+  if (idx->data_end >= idx->file_end)
+    return 0;
+  uint64_t end = idx->file_end;
+  if (end - idx->data_end < HDR_SIZE + 1)
+    end = idx->data_end + HDR_SIZE + 1;
+  struct entry_header h;
+  memset(&h, 0, sizeof(h));
+  h.version = HDR_VERSION;
+  h.deleted = 1;
+  h.name_len = 1;
+  h.content_len = h.stored_len = end - idx->data_end - HDR_SIZE - 1;
+  if (!index_add(idx, FILLER_NAME, idx->data_end, &h))
+    return -1;
+  idx->filler = idx->data_end;
+  idx->data_end = end;
+  return 0;
+}
+
+// Writes the trailer after the last entry and makes the update durable.
+// Only then are the filler header and the tombstones of entries deleted
+// by this update written, since the old trailer and the old headers are
+// what is left if the update does not complete.
+static int commit_index(int fd, struct archive_index *idx) {
+  if (skip_old_trailer(idx) < 0)
+    return -1;
+  if (lseek(fd, (off_t)idx->data_end, SEEK_SET) == (off_t)-1) {
+    perror("lseek");
+    return -1;
+  }
+  if (write_index(fd, idx) < 0) {
+    perror("write index");
+    return -1;
+  }
+  off_t end = lseek(fd, 0, SEEK_CUR);
+  if (end == (off_t)-1 || ftruncate(fd, end) < 0) {
+    perror("ftruncate");
+    return -1;
+  }
+  if (fsync(fd) < 0) {
+    perror("fsync");
+    return -1;
+  }
+
+  int rc = 0;
+  struct index_entry *f =
+      idx->filler != UINT64_MAX ? index_find_offset(idx, idx->filler) : NULL;
+  if (f && write_filler(fd, f) < 0)
+    rc = -1;
+  idx->filler = UINT64_MAX;
+  for (size_t i = 0; i < idx->count; i++) {
+    struct index_entry *e = &idx->entries[i];
+    if (!(e->flags & IDX_PENDING))
+      continue;
+    uint8_t one = 1;
+    uint64_t at =
+        e->offset + ((e->flags & IDX_LEGACY_HDR) ? LEGACY_DELETED_OFF
+                                                 : HDR_DELETED_OFF);
+    if (pwrite(fd, &one, 1, (off_t)at) != 1) {
+      perror("write tombstone");
+      rc = -1;
+    }
+    e->flags &= ~IDX_PENDING;
+  }
+  if (fsync(fd) < 0)
+    perror("fsync");
+  return rc;
+}
+
+// Marks e deleted. Its header is flipped by commit_index().
+static void tombstone_entry(struct index_entry *e) {
+  e->flags |= IDX_DELETED | IDX_PENDING;
+}
+
+// Appends src_fd, whose metadata is st, as member `name` at
+// idx->data_end, past the old trailer. commit_index() must follow.
+// src_path is only used in messages.
+static int append_entry(int fd, struct archive_index *idx, const char *name,
+                        int src_fd, const struct stat *st,
+                        const char *src_path) {
+  size_t name_len = strlen(name);
+  if (name_len == 0 || name_len > MAX_NAME_LEN) {
+    fprintf(stderr, "bad member name: %s\n", name);
+    return -1;
+  }
+  struct entry_header nh;
+  memset(&nh, 0, sizeof(nh));
+  nh.version = HDR_VERSION;
+  nh.name_len = (uint32_t)name_len;
+  nh.content_len = (uint64_t)st->st_size;
+  nh.mode = (uint32_t)st->st_mode;
+  nh.uid = (uint32_t)st->st_uid;
+  nh.gid = (uint32_t)st->st_gid;
+  nh.mtime = (int64_t)st->st_mtime;
+  nh.deleted = 0;
+  nh.codec = (uint8_t)codec;
+  nh.stored_len = nh.content_len;
+
+  uint8_t digest[DIGEST_LEN];
+  int have_digest = 0;
+  if (dedup && nh.content_len > 0) {
+    if (hash_file(src_fd, nh.content_len, digest) < 0) {
+      fprintf(stderr, "hash %s failed\n", src_path);
+      return -1;
+    }
+    have_digest = 1;
+    struct index_entry *same = index_find_digest(idx, digest, nh.content_len);
+    if (same) {
+      nh.flags = HDR_REF;
+      nh.ref_off = same->offset;
+      nh.codec = CODEC_NONE;
+      nh.stored_len = 0;
+    }
+  }
+
+  if (skip_old_trailer(idx) < 0)
+    return -1;
+  if (lseek(fd, (off_t)idx->data_end, SEEK_SET) == (off_t)-1) {
+    perror("lseek");
+    return -1;
+  }
+  if (write_header(fd, &nh, name) < 0) {
+    perror("write hdr");
+    return -1;
+  }
+  uint64_t data_off = idx->data_end + HDR_SIZE + nh.name_len;
+  if (nh.flags & HDR_REF) {
+    // The content is already in the archive.
+  } else if (nh.codec == CODEC_NONE) {
+    // The kernel copy never shows us the bytes: checksum what landed.
+    int (*crc_fn)(int, uint64_t, uint64_t, uint32_t *) =
+        pool.nthreads > 0 && nh.content_len > BLOCK_SIZE ? crc_range_pool
+                                                         : crc_range;
+    if (copy_bytes(src_fd, fd, nh.content_len) < 0 ||
+        crc_fn(fd, data_off, nh.content_len, &nh.data_crc) < 0) {
+      perror("copy file");
+      return -1;
+    }
+  } else {
+    if (compress_stream(src_fd, fd, nh.codec, nh.content_len,
+                        &nh.stored_len, &nh.data_crc) < 0) {
+      fprintf(stderr, "compress %s failed\n", src_path);
+      return -1;
+    }
+    nh.flags |= HDR_BLOCKS;
+  }
+  // The stored size and checksums are known only now: patch the header.
+  if (!(nh.flags & HDR_REF)) {
+    uint8_t hbuf[HDR_SIZE];
+    encode_header(hbuf, &nh, name);
+    if (pwrite(fd, hbuf, HDR_SIZE, (off_t)idx->data_end) != HDR_SIZE) {
+      perror("write hdr");
+      return -1;
+    }
+  }
+  struct index_entry *e = index_add(idx, name, idx->data_end, &nh);
+  if (!e || (have_digest && index_set_digest(idx, e, digest) < 0))
+    return -1;
+  idx->data_end += HDR_SIZE + nh.name_len + nh.stored_len;
+  return 0;
+}
+
+// A file to add: the path to open, the member name (a suffix of path)
+// and the metadata gathered while collecting it.
+struct add_item {
+  char *path;
+  const char *name;
+  struct stat st;
+};
+
+struct add_list {
+  struct add_item *v;
+  size_t n, cap;
+};
+
+static int add_list_push(struct add_list *l, char *path, size_t name_off,
+                         const struct stat *st) {
+  if (l->n == l->cap) {
+    size_t ncap = l->cap ? l->cap * 2 : 64;
+    struct add_item *nv =
+        (struct add_item *)realloc(l->v, ncap * sizeof(*nv));
+    if (!nv) {
+      perror("realloc");
+      return -1;
+    }
+    l->v = nv;
+    l->cap = ncap;
+  }
+  l->v[l->n].path = path;
+  l->v[l->n].name = path + name_off;
+  l->v[l->n].st = *st;
+  l->n++;
+  return 0;
+}
+
+static void add_list_free(struct add_list *l) {
+  for (size_t i = 0; i < l->n; i++)
+    free(l->v[i].path);
+  free(l->v);
+}
+
+static int add_item_cmp(const void *a, const void *b) {
+  return strcmp(((const struct add_item *)a)->path,
+                ((const struct add_item *)b)->path);
+}
+
+static char *join_path(const char *dir, const char *name) {
+  size_t dl = strlen(dir);
+  size_t nl = strlen(name);
+  int sep = dl > 0 && dir[dl - 1] != '/';
+  char *p = (char *)malloc(dl + sep + nl + 1);
+  if (!p) {
+    perror("malloc");
+    return NULL;
+  }
+  memcpy(p, dir, dl);
+  if (sep)
+    p[dl] = '/';
+  memcpy(p + dl + sep, name, nl + 1);
+  return p;
+}
+
+// Parallel directory walk: workers take directories off a shared stack,
+// read them and fstatat every entry, so the per-file metadata latency of
+// a large tree overlaps instead of adding up.
+struct walk {
+  pthread_mutex_t mtx;
+  pthread_cond_t cond;
+  char **dirs; // pending directories
+  size_t ndirs, dcap;
+  int busy; // workers reading a directory
+  size_t name_off;
+  struct add_list files;
+  int failed;
+};
+
+static int walk_push_dir(struct walk *w, char *dir) {
+  if (w->ndirs == w->dcap) {
+    size_t ncap = w->dcap ? w->dcap * 2 : 64;
+    char **nd = (char **)realloc(w->dirs, ncap * sizeof(*nd));
+    if (!nd) {
+      perror("realloc");
+      return -1;
+    }
+    w->dirs = nd;
+    w->dcap = ncap;
+  }
+  w->dirs[w->ndirs++] = dir;
+  return 0;
+}
+
+// Reads one directory into local lists, then merges them under the lock.
+static int walk_dir(struct walk *w, const char *dir) {
+  DIR *dp = opendir(dir);
+  if (!dp) {
+    perror(dir);
+    return -1;
+  }
+  struct add_list files = {NULL, 0, 0};
+  char **subdirs = NULL;
+  size_t nsub = 0, subcap = 0;
+  int rc = 0;
+  struct dirent *de;
+  while ((de = readdir(dp)) != NULL) {
+    if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+      continue;
+    struct stat st;
+    if (fstatat(dirfd(dp), de->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+      fprintf(stderr, "%s/%s: %s\n", dir, de->d_name, strerror(errno));
+      rc = -1;
+      continue;
+    }
+    if (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode)) {
+      fprintf(stderr, "skipping %s/%s: not a regular file\n", dir,
+              de->d_name);
+      continue;
+    }
+    char *path = join_path(dir, de->d_name);
+    if (!path) {
+      rc = -1;
+      break;
+    }
+    if (S_ISDIR(st.st_mode)) {
+      if (nsub == subcap) {
+        subcap = subcap ? subcap * 2 : 16;
+        char **ns = (char **)realloc(subdirs, subcap * sizeof(*ns));
+        if (!ns) {
+          perror("realloc");
+          free(path);
+          rc = -1;
+          break;
+        }
+        subdirs = ns;
+      }
+      subdirs[nsub++] = path;
+    } else if (add_list_push(&files, path, w->name_off, &st) < 0) {
+      free(path);
+      rc = -1;
+      break;
+    }
+  }
+  closedir(dp);
+
+  pthread_mutex_lock(&w->mtx);
+  for (size_t i = 0; i < nsub; i++) {
+    if (rc == 0 && walk_push_dir(w, subdirs[i]) == 0)
+      continue;
+    free(subdirs[i]);
+    rc = -1;
+  }
+  for (size_t i = 0; i < files.n; i++) {
+    if (rc == 0 && add_list_push(&w->files, files.v[i].path, w->name_off,
+                                 &files.v[i].st) == 0)
+      continue;
+    free(files.v[i].path);
+    rc = -1;
+  }
+  pthread_mutex_unlock(&w->mtx);
+  free(files.v);
+  free(subdirs);
+  return rc;
+}
+
+static void *walk_worker(void *arg) {
+  struct walk *w = (struct walk *)arg;
+  pthread_mutex_lock(&w->mtx);
+  for (;;) {
+    while (w->ndirs == 0 && w->busy > 0)
+      pthread_cond_wait(&w->cond, &w->mtx);
+    if (w->ndirs == 0)
+      break;
+    char *dir = w->dirs[--w->ndirs];
+    w->busy++;
+    pthread_mutex_unlock(&w->mtx);
+    int rc = walk_dir(w, dir);
+    free(dir);
+    pthread_mutex_lock(&w->mtx);
+    if (rc < 0)
+      w->failed = 1;
+    w->busy--;
+    pthread_cond_broadcast(&w->cond);
+  }
+  pthread_cond_broadcast(&w->cond);
+  pthread_mutex_unlock(&w->mtx);
+  return NULL;
+}
+
+// Collects the regular files below root into out, sorted by path so the
+// archive order does not depend on thread timing. Member names keep the
+// path relative to the parent of root ("a/b/dir" gives "dir/...").
+static int walk_tree(const char *root, int nthreads, struct add_list *out) {
+  size_t len = strlen(root);
+  while (len > 1 && root[len - 1] == '/')
+    len--;
+  char *top = strndup(root, len);
+  if (!top) {
+    perror("strndup");
+    return -1;
+  }
+  struct walk w;
+  memset(&w, 0, sizeof(w));
+  pthread_mutex_init(&w.mtx, NULL);
+  pthread_cond_init(&w.cond, NULL);
+  const char *slash = strrchr(top, '/');
+  const char *base = slash ? slash + 1 : top;
+  if (!strcmp(base, ".") || !strcmp(base, "..") || !strcmp(top, "/"))
+    w.name_off = len + (top[len - 1] != '/'); // names relative to root
+  else
+    w.name_off = (size_t)(base - top);
+  if (walk_push_dir(&w, top) < 0) {
+    free(top);
+    w.failed = 1;
+  } else {
+    pthread_t *th = (pthread_t *)calloc((size_t)nthreads, sizeof(*th));
+    int started = 0;
+    for (int t = 0; th && t < nthreads; t++) {
+      if (pthread_create(&th[t], NULL, walk_worker, &w) != 0)
+        break;
+      started++;
+    }
+    if (started == 0)
+      walk_worker(&w);
+    for (int t = 0; t < started; t++)
+      pthread_join(th[t], NULL);
+    free(th);
+  }
+  for (size_t i = 0; i < w.ndirs; i++)
+    free(w.dirs[i]);
+  free(w.dirs);
+  pthread_mutex_destroy(&w.mtx);
+  pthread_cond_destroy(&w.cond);
+
+  qsort(w.files.v, w.files.n, sizeof(*w.files.v), add_item_cmp);
+  for (size_t i = 0; i < w.files.n; i++) {
+    struct add_item *it = &w.files.v[i];
+    if (w.failed ||
+        add_list_push(out, it->path, (size_t)(it->name - it->path),
+                      &it->st) < 0) {
+      free(it->path);
+      w.failed = 1;
+    }
+  }
+  free(w.files.v);
+  return w.failed ? -1 : 0;
+}
+
+#define READAHEAD_FILES 16
+#define WALK_THREADS 8
+
+// Opens item i and asks the kernel to start reading it. Small files are
+// then already in the page cache by the time they are copied.
+static int open_ahead(const struct add_item *it) {
+  int src_fd = open(it->path, O_RDONLY);
+  if (src_fd < 0) {
+    perror(it->path);
+    return -1;
+  }
+  posix_fadvise(src_fd, 0, 0, POSIX_FADV_WILLNEED);
+  return src_fd;
+}
+
+// Adds all files in one pass: each is appended after the previous one,
+// older versions are tombstoned, and the index is written once at the end.
+// Directories are added recursively. Up to READAHEAD_FILES upcoming files
+// are kept open with readahead requested while the current one is copied.
+static int add_files(const char *arch_path, char **src_paths, size_t n,
+                     int nthreads) {
+  struct add_list items = {NULL, 0, 0};
+  int rc = 0;
+  size_t added = 0;
+  for (size_t i = 0; i < n; i++) {
+    struct stat st;
+    if (stat(src_paths[i], &st) < 0) {
+      perror(src_paths[i]);
+      rc = 1;
+      continue;
+    }
+    if (S_ISDIR(st.st_mode)) {
+      if (walk_tree(src_paths[i], nthreads > 1 ? nthreads : WALK_THREADS,
+                    &items) < 0)
+        rc = 1;
+      continue;
+    }
+    char *path = strdup(src_paths[i]);
+    if (!path) {
+      perror("strdup");
+      rc = 1;
+      continue;
+    }
+    const char *slash = strrchr(path, '/');
+    if (add_list_push(&items, path, slash ? (size_t)(slash + 1 - path) : 0,
+                      &st) < 0) {
+      free(path);
+      rc = 1;
+    }
+  }
+
+  struct archive_index idx;
+  int fd = open_for_update(arch_path, O_CREAT, &idx);
+  if (fd < 0) {
+    add_list_free(&items);
+    return 1;
+  }
+  int ahead[READAHEAD_FILES];
+  for (size_t i = 0; i < items.n && i < READAHEAD_FILES; i++)
+    ahead[i] = open_ahead(&items.v[i]);
+  for (size_t i = 0; i < items.n; i++) {
+    int src_fd = ahead[i % READAHEAD_FILES];
+    if (i + READAHEAD_FILES < items.n)
+      ahead[i % READAHEAD_FILES] = open_ahead(&items.v[i + READAHEAD_FILES]);
+    const struct add_item *it = &items.v[i];
+    if (src_fd < 0) {
+      rc = 1;
+      continue;
+    }
+    // Remember the old version by position: index_add() may move the array.
+    struct index_entry *old = index_lookup(&idx, it->name);
+    size_t old_pos = old ? (size_t)(old - idx.entries) : 0;
+    int ra = append_entry(fd, &idx, it->name, src_fd, &it->st, it->path);
+    close(src_fd);
+    if (ra < 0) {
+      rc = 1;
+      continue;
+    }
+    if (old)
+      tombstone_entry(&idx.entries[old_pos]);
+    added++;
+  }
+  // Without a single new entry the old trailer stays in use; only what
+  // failed appends left after it is dropped.
+  if (added ? commit_index(fd, &idx) < 0
+            : ftruncate(fd, (off_t)idx.file_end) < 0)
+    rc = 1;
+  index_free(&idx);
+  close(fd);
+  add_list_free(&items);
+  return rc;
+}
+
+// Returns the content checksum of e from its header, or computes it for
+// entries written before checksums existed.
+static int entry_data_crc(int fd, const struct index_entry *e,
+                          uint32_t *crc) {
+  uint8_t buf[HDR_SIZE];
+  struct entry_header h;
+  ssize_t r = pread(fd, buf, HDR_SIZE, (off_t)e->offset);
+  if (r > 0 && decode_header(buf, (size_t)r, &h) > 0 && (h.flags & HDR_CRC)) {
+    *crc = h.data_crc;
+    return 0;
   }
-  close(fd);
-  return 0;
+  return crc_range(fd, entry_data_off(e), e->stored_len, crc);
 }
 
-static int rewrite_without(const char *arch_path, const char *remove_name,
-                           const char *replace_name,
-                           const char *replace_src_path) {
+// Copies live entries into a fresh archive, dropping tombstoned ones.
+static int compact_archive(const char *arch_path) {
   char tmp_path[4096];
   snprintf(tmp_path, sizeof(tmp_path), "%s.tmp.%ld", arch_path, (long)getpid());
 
-  int in_fd = open(arch_path, O_RDONLY | O_CREAT, 0644);
+  // Held until the replacement is renamed into place; writers waiting on
+  // the old file notice the rename and reopen.
+  int in_fd = open_locked(arch_path, O_RDWR, F_WRLCK);
   if (in_fd < 0) {
     perror("open input archive");
     return 1;
   }
-  int out_fd = open(tmp_path, O_WRONLY | O_TRUNC | O_CREAT, 0644);
+  struct archive_index old_idx;
+  if (load_index(in_fd, &old_idx) < 0) {
+    close(in_fd);
+    return 1;
+  }
+  if (!old_idx.present && scan_index(in_fd, &old_idx) < 0) {
+    index_free(&old_idx);
+    close(in_fd);
+    return 1;
+  }
+  struct stat st;
+  if (fstat(in_fd, &st) < 0) {
+    perror("fstat");
+    index_free(&old_idx);
+    close(in_fd);
+    return 1;
+  }
+
+  int out_fd =
+      open(tmp_path, O_WRONLY | O_TRUNC | O_CREAT, st.st_mode & 07777);
   if (out_fd < 0) {
     perror("open temp");
+    index_free(&old_idx);
     close(in_fd);
     return 1;
   }
 
-  if (lseek(in_fd, 0, SEEK_SET) == (off_t)-1) {
-    perror("lseek in");
+  // moved[i]: new header offset of the entry now holding old entry i's
+  // data, so references can be redirected.
+  uint64_t *moved = (uint64_t *)malloc((old_idx.count + 1) * sizeof(*moved));
+  if (!moved) {
+    perror("malloc");
+    index_free(&old_idx);
     close(in_fd);
     close(out_fd);
     unlink(tmp_path);
     return 1;
   }
+  for (size_t i = 0; i < old_idx.count; i++)
+    moved[i] = UINT64_MAX;
 
-  struct entry_header hdr;
-  while (1) {
-    ssize_t r = 0;
-    int rh = read_header(in_fd, &hdr, &r);
-    if (rh == 0)
-      break;
-    if (rh < 0) {
-      fprintf(stderr, "corrupt archive while copy\n");
-      close(in_fd);
-      close(out_fd);
-      unlink(tmp_path);
-      return 1;
-    }
-
-    if (hdr.name_len == 0 || hdr.name_len > (1u << 20)) {
-      fprintf(stderr, "corrupt archive (name_len)\n");
-      close(in_fd);
-      close(out_fd);
-      unlink(tmp_path);
-      return 1;
-    }
-    char *name = (char *)malloc(hdr.name_len + 1);
-    if (!name) {
-      perror("malloc");
-      close(in_fd);
-      close(out_fd);
-      unlink(tmp_path);
-      return 1;
-    }
-    if (read_full(in_fd, name, hdr.name_len) < 0) {
-      perror("read name");
-      free(name);
-      close(in_fd);
-      close(out_fd);
-      unlink(tmp_path);
-      return 1;
+  struct archive_index idx;
+  index_init(&idx);
+  uint64_t out_pos = 0;
+  size_t dropped = 0;
+  for (size_t i = 0; i < old_idx.count; i++) {
+    struct index_entry *e = &old_idx.entries[i];
+    if (e->flags & IDX_DELETED) {
+      dropped++;
+      continue;
     }
-    name[hdr.name_len] = '\0';
-
-    int should_remove =
-        (remove_name && strcmp(name, remove_name) == 0 && !hdr.deleted);
-    if (!should_remove) {
-      if (write_header(out_fd, &hdr) < 0) {
-        perror("write hdr");
-        free(name);
-        close(in_fd);
-        close(out_fd);
-        unlink(tmp_path);
-        return 1;
-      }
-      if (write_full(out_fd, name, hdr.name_len) < 0) {
-        perror("write name");
-        free(name);
+    struct entry_header hdr;
+    entry_to_header(e, &hdr);
+    hdr.version = HDR_VERSION;
+    const struct index_entry *src = e;
+    if (e->flags & IDX_REF) {
+      // References point backwards, so the target was handled already.
+      // If it was dropped, this entry takes over its data.
+      struct index_entry *t = index_find_offset(&old_idx, e->ref_off);
+      if (!t || (t->flags & IDX_REF)) {
+        fprintf(stderr, "corrupt archive (bad reference from %s)\n",
+                e->name);
+        free(moved);
+        index_free(&idx);
+        index_free(&old_idx);
         close(in_fd);
         close(out_fd);
         unlink(tmp_path);
         return 1;
       }
-      if (copy_bytes(in_fd, out_fd, hdr.content_len) < 0) {
-        perror("copy content");
-        free(name);
-        close(in_fd);
-        close(out_fd);
-        unlink(tmp_path);
-        return 1;
+      size_t ti = (size_t)(t - old_idx.entries);
+      if (moved[ti] != UINT64_MAX) {
+        hdr.ref_off = moved[ti];
+        src = NULL;
+      } else {
+        hdr.flags = (t->flags & IDX_BLOCKS) ? HDR_BLOCKS : 0;
+        hdr.ref_off = 0;
+        hdr.codec = (uint8_t)(t->flags >> 8);
+        hdr.stored_len = t->stored_len;
+        src = t;
+        moved[ti] = out_pos;
       }
     } else {
-      if (lseek(in_fd, (off_t)hdr.content_len, SEEK_CUR) == (off_t)-1) {
-        char buf[BUF_SIZE];
-        uint64_t remaining = hdr.content_len;
-        while (remaining > 0) {
-          size_t chunk = remaining > BUF_SIZE ? BUF_SIZE : (size_t)remaining;
-          ssize_t rr = read_full(in_fd, buf, chunk);
-          if (rr <= 0) {
-            perror("skip");
-            free(name);
-            close(in_fd);
-            close(out_fd);
-            unlink(tmp_path);
-            return 1;
-          }
-          remaining -= (uint64_t)rr;
-        }
-      }
-    }
-    free(name);
-  }
-
-  // optionally append replacement (used by -i)
-  if (replace_name && replace_src_path) {
-    int src_fd = open(replace_src_path, O_RDONLY);
-    if (src_fd < 0) {
-      perror("open src");
-      close(in_fd);
-      close(out_fd);
-      unlink(tmp_path);
-      return 1;
-    }
-    struct stat st;
-    if (fstat(src_fd, &st) < 0) {
-      perror("fstat");
-      close(src_fd);
-      close(in_fd);
-      close(out_fd);
-      unlink(tmp_path);
-      return 1;
-    }
-    struct entry_header nh;
-    memset(&nh, 0, sizeof(nh));
-    nh.name_len = (uint32_t)strlen(replace_name);
-    nh.content_len = (uint64_t)st.st_size;
-    nh.mode = (uint32_t)st.st_mode;
-    nh.uid = (uint32_t)st.st_uid;
-    nh.gid = (uint32_t)st.st_gid;
-    nh.mtime = (int64_t)st.st_mtime;
-    nh.deleted = 0;
-
-    if (write_header(out_fd, &nh) < 0) {
-      perror("write hdr");
-      close(src_fd);
-      close(in_fd);
-      close(out_fd);
-      unlink(tmp_path);
-      return 1;
+      moved[i] = out_pos;
     }
-    if (write_full(out_fd, replace_name, nh.name_len) < 0) {
-      perror("write name");
-      close(src_fd);
+    struct index_entry *ne = NULL;
+    if (src && entry_data_crc(in_fd, src, &hdr.data_crc) < 0) {
+      fprintf(stderr, "checksum %s failed\n", e->name);
+      free(moved);
+      index_free(&idx);
+      index_free(&old_idx);
       close(in_fd);
       close(out_fd);
       unlink(tmp_path);
       return 1;
     }
-    if (copy_bytes(src_fd, out_fd, nh.content_len) < 0) {
-      perror("copy file");
-      close(src_fd);
+    if (write_header(out_fd, &hdr, e->name) < 0 ||
+        (src && (lseek(in_fd, (off_t)entry_data_off(src), SEEK_SET) ==
+                     (off_t)-1 ||
+                 copy_bytes(in_fd, out_fd, src->stored_len) < 0)) ||
+        !(ne = index_add(&idx, e->name, out_pos, &hdr)) ||
+        index_set_digest(&idx, ne, e->digest) < 0) {
+      perror("copy entry");
+      free(moved);
+      index_free(&idx);
+      index_free(&old_idx);
       close(in_fd);
       close(out_fd);
       unlink(tmp_path);
       return 1;
     }
-    close(src_fd);
+    out_pos += HDR_SIZE + hdr.name_len + hdr.stored_len;
   }
+  free(moved);
+  index_free(&old_idx);
 
-  close(in_fd);
+  idx.data_end = out_pos;
+  if (write_index(out_fd, &idx) < 0) {
+    perror("write index");
+    index_free(&idx);
+    close(in_fd);
+    close(out_fd);
+    unlink(tmp_path);
+    return 1;
+  }
+  index_free(&idx);
+  off_t new_size = lseek(out_fd, 0, SEEK_CUR);
   if (fsync(out_fd) < 0) {
     perror("fsync");
   }
@@ -431,127 +2840,672 @@ static int rewrite_without(const char *arch_path, const char *remove_name,
   if (rename(tmp_path, arch_path) < 0) {
     perror("rename");
     unlink(tmp_path);
+    close(in_fd);
     return 1;
   }
+  close(in_fd);
+  long long reclaimed = (long long)st.st_size - (long long)new_size;
+  printf("compact: dropped %zu deleted entries, reclaimed %lld bytes\n",
+         dropped, reclaimed > 0 ? reclaimed : 0);
   return 0;
 }
 
-static int add_file(const char *arch_path, const char *src_path) {
-  const char *slash = strrchr(src_path, '/');
-  const char *name = slash ? slash + 1 : src_path;
-  return rewrite_without(arch_path, name, name, src_path);
-}
+enum { VERIFY_OK, VERIFY_BAD, VERIFY_UNCHECKED };
 
-static int extract_file(const char *arch_path, const char *want_name) {
-  int fd = open(arch_path, O_RDONLY);
-  if (fd < 0) {
-    perror("open");
-    return 1;
+// Re-reads the header of e and checks it against the index and both
+// checksums. *why explains a VERIFY_BAD result.
+static int verify_entry(int fd, const struct index_entry *e,
+                        const char **why) {
+  size_t hs = (e->flags & IDX_LEGACY_HDR) ? LEGACY_HDR_SIZE : HDR_SIZE;
+  size_t len = hs + e->name_len;
+  uint8_t *buf = (uint8_t *)malloc(len);
+  if (!buf) {
+    *why = "out of memory";
+    return VERIFY_BAD;
+  }
+  struct entry_header h;
+  int rc = VERIFY_OK;
+  if (pread(fd, buf, len, (off_t)e->offset) != (ssize_t)len) {
+    *why = "short read";
+    rc = VERIFY_BAD;
+  } else if (decode_header(buf, len, &h) != (int)hs) {
+    // A filler's header is missing until the next update if the one that
+    // made it was interrupted.
+    *why = "bad header";
+    rc = is_filler(e) ? VERIFY_UNCHECKED : VERIFY_BAD;
+  } else if (h.name_len != e->name_len ||
+             memcmp(buf + hs, e->name, e->name_len) != 0 ||
+             h.content_len != e->content_len ||
+             h.stored_len != e->stored_len ||
+             !(h.flags & HDR_REF) != !(e->flags & IDX_REF) ||
+             !(h.flags & HDR_BLOCKS) != !(e->flags & IDX_BLOCKS)) {
+    *why = "header does not match index";
+    rc = VERIFY_BAD;
+  } else if (!(h.flags & HDR_CRC)) {
+    rc = VERIFY_UNCHECKED;
+  } else if (header_crc(buf, (const char *)buf + hs, h.name_len) !=
+             get_u32(buf + 60)) {
+    *why = "header checksum mismatch";
+    rc = VERIFY_BAD;
+  } else if (!(h.flags & HDR_REF)) {
+    uint32_t crc;
+    if (crc_range(fd, entry_data_off(e), e->stored_len, &crc) < 0) {
+      *why = "short read";
+      rc = VERIFY_BAD;
+    } else if (crc != h.data_crc) {
+      *why = "content checksum mismatch";
+      rc = VERIFY_BAD;
+    }
   }
+  free(buf);
+  return rc;
+}
 
-  struct entry_header hdr;
-  int found = 0;
-  while (1) {
-    ssize_t r = 0;
-    int rh = read_header(fd, &hdr, &r);
-    if (rh == 0)
+struct verify_ctx {
+  pthread_mutex_t mtx;
+  int fd;
+  struct archive_index *idx;
+  size_t next;
+  uint8_t *status;
+  const char **why;
+};
+
+static void *verify_worker(void *arg) {
+  struct verify_ctx *vc = (struct verify_ctx *)arg;
+  for (;;) {
+    pthread_mutex_lock(&vc->mtx);
+    size_t i = vc->next++;
+    pthread_mutex_unlock(&vc->mtx);
+    if (i >= vc->idx->count)
       break;
-    if (rh < 0) {
-      fprintf(stderr, "corrupt archive\n");
-      close(fd);
-      return 1;
+    vc->status[i] = (uint8_t)verify_entry(vc->fd, &vc->idx->entries[i],
+                                          &vc->why[i]);
+  }
+  return NULL;
+}
+
+// Checks every entry, deleted ones included since references may still
+// use their data. One thread streams the archive front to back; with
+// nthreads > 1 the index is split among workers.
+static int verify_archive(const char *arch_path, int nthreads) {
+  struct archive_index idx;
+  int fd = open_snapshot(arch_path, &idx);
+  if (fd < 0)
+    return 1;
+  int rc = 0;
+  // Entries must tile the data area exactly.
+  uint64_t pos = 0;
+  for (size_t i = 0; i < idx.count; i++) {
+    const struct index_entry *e = &idx.entries[i];
+    if (e->offset != pos) {
+      printf("verify: index: gap or overlap before %s at offset %lu\n",
+             e->name, (unsigned long)e->offset);
+      rc = 1;
     }
-    if (hdr.name_len == 0 || hdr.name_len > (1u << 20)) {
-      fprintf(stderr, "corrupt archive (name_len)\n");
-      close(fd);
-      return 1;
+    pos = entry_data_off(e) + e->stored_len;
+  }
+  if (pos != idx.data_end) {
+    printf("verify: index: data ends at %lu, entries at %lu\n",
+           (unsigned long)idx.data_end, (unsigned long)pos);
+    rc = 1;
+  }
+
+  struct verify_ctx vc;
+  memset(&vc, 0, sizeof(vc));
+  pthread_mutex_init(&vc.mtx, NULL);
+  vc.fd = fd;
+  vc.idx = &idx;
+  vc.status = (uint8_t *)calloc(idx.count + 1, 1);
+  vc.why = (const char **)calloc(idx.count + 1, sizeof(*vc.why));
+  if (!vc.status || !vc.why) {
+    perror("calloc");
+    free(vc.status);
+    free(vc.why);
+    index_free(&idx);
+    close(fd);
+    return 1;
+  }
+  if (nthreads <= 1) {
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    verify_worker(&vc);
+  } else {
+    pthread_t *th = (pthread_t *)calloc((size_t)nthreads, sizeof(*th));
+    int started = 0;
+    for (int t = 0; th && t < nthreads; t++) {
+      if (pthread_create(&th[t], NULL, verify_worker, &vc) != 0)
+        break;
+      started++;
     }
-    char *name = (char *)malloc(hdr.name_len + 1);
-    if (!name) {
-      perror("malloc");
-      close(fd);
-      return 1;
+    if (started == 0)
+      verify_worker(&vc);
+    for (int t = 0; t < started; t++)
+      pthread_join(th[t], NULL);
+    free(th);
+  }
+
+  size_t ok = 0, bad = 0, unchecked = 0;
+  for (size_t i = 0; i < idx.count; i++) {
+    if (vc.status[i] == VERIFY_BAD) {
+      printf("verify: %s: %s\n", idx.entries[i].name, vc.why[i]);
+      bad++;
+    } else if (vc.status[i] == VERIFY_UNCHECKED) {
+      unchecked++;
+    } else {
+      ok++;
     }
-    if (read_full(fd, name, hdr.name_len) < 0) {
-      perror("read name");
-      free(name);
-      close(fd);
-      return 1;
+  }
+  printf("verify: %zu ok, %zu without checksums, %zu bad\n", ok, unchecked,
+         bad);
+  if (bad)
+    rc = 1;
+  free(vc.status);
+  free(vc.why);
+  pthread_mutex_destroy(&vc.mtx);
+  index_free(&idx);
+  close(fd);
+  return rc;
+}
+
+// Member names are relative paths; refuse anything that would land
+// outside the extraction directory.
+static int safe_member_name(const char *name) {
+  if (name[0] == '/')
+    return 0;
+  for (const char *p = name; *p;) {
+    const char *end = strchr(p, '/');
+    size_t len = end ? (size_t)(end - p) : strlen(p);
+    if (len == 2 && p[0] == '.' && p[1] == '.')
+      return 0;
+    p += len;
+    while (*p == '/')
+      p++;
+  }
+  return 1;
+}
+
+// Creates the directories leading up to name under dir_fd.
+static int make_parents(int dir_fd, const char *name) {
+  char *path = strdup(name);
+  if (!path) {
+    perror("strdup");
+    return -1;
+  }
+  for (char *p = strchr(path, '/'); p; p = strchr(p + 1, '/')) {
+    *p = '\0';
+    if (mkdirat(dir_fd, path, 0755) < 0 && errno != EEXIST) {
+      perror(path);
+      free(path);
+      return -1;
     }
-    name[hdr.name_len] = '\0';
+    *p = '/';
+  }
+  free(path);
+  return 0;
+}
 
-    if (!hdr.deleted && strcmp(name, want_name) == 0) {
-      found = 1;
-      int out_fd = open(name, O_WRONLY | O_TRUNC | O_CREAT, 0600);
-      if (out_fd < 0) {
-        perror("open out");
-        free(name);
-        close(fd);
-        return 1;
-      }
-      if (copy_bytes(fd, out_fd, hdr.content_len) < 0) {
-        perror("write out");
-        free(name);
-        close(out_fd);
-        close(fd);
-        return 1;
-      }
-      if (fchmod(out_fd, hdr.mode) < 0)
-        perror("chmod");
-      if (fchown(out_fd, hdr.uid, hdr.gid) < 0)
-        perror("chown");
-      struct timespec times[2];
-      times[0].tv_sec = hdr.mtime;
-      times[0].tv_nsec = 0;
-      times[1].tv_sec = hdr.mtime;
-      times[1].tv_nsec = 0;
-      if (utimensat(AT_FDCWD, name, times, 0) < 0)
-        perror("utimensat");
-      close(out_fd);
-      free(name);
-      break;
-    } else {
-      if (lseek(fd, (off_t)hdr.content_len, SEEK_CUR) == (off_t)-1) {
-        char buf[BUF_SIZE];
-        uint64_t remaining = hdr.content_len;
-        while (remaining > 0) {
-          size_t chunk = remaining > BUF_SIZE ? BUF_SIZE : (size_t)remaining;
-          ssize_t rr = read_full(fd, buf, chunk);
-          if (rr <= 0) {
-            perror("skip");
-            free(name);
-            close(fd);
-            return 1;
-          }
-          remaining -= (uint64_t)rr;
-        }
+// Writes the member content to `name` under dir_fd: from src when the
+// archive is mapped, otherwise from the current position of fd.
+static int write_member(int fd, const uint8_t *src, int dir_fd,
+                        const char *name, const struct entry_header *hdr) {
+  if (!safe_member_name(name)) {
+    fprintf(stderr, "refusing to extract %s: path leaves the directory\n",
+            name);
+    return -1;
+  }
+  // Before O_TRUNC: an existing file must survive a member we can't decode.
+  if (!codec_available(hdr->codec)) {
+    fprintf(stderr, "%s: codec %s is not built into this archiver\n", name,
+            codec_name(hdr->codec));
+    return -1;
+  }
+  int out_fd = openat(dir_fd, name, O_WRONLY | O_TRUNC | O_CREAT, 0600);
+  if (out_fd < 0 && errno == ENOENT && strchr(name, '/') &&
+      make_parents(dir_fd, name) == 0)
+    out_fd = openat(dir_fd, name, O_WRONLY | O_TRUNC | O_CREAT, 0600);
+  if (out_fd < 0) {
+    perror("open out");
+    return -1;
+  }
+  int rc;
+  if (src)
+    rc = hdr->codec == CODEC_NONE
+             ? write_full(out_fd, src, hdr->content_len)
+             : decompress_mem(src, out_fd, hdr->codec, frames_len(hdr),
+                              hdr->content_len);
+  else
+    rc = hdr->codec == CODEC_NONE
+             ? copy_bytes(fd, out_fd, hdr->content_len)
+             : decompress_stream(fd, out_fd, hdr->codec, frames_len(hdr),
+                                 hdr->content_len);
+  if (rc < 0) {
+    fprintf(stderr, "write out %s failed\n", name);
+    close(out_fd);
+    return -1;
+  }
+  if (fchmod(out_fd, hdr->mode) < 0)
+    perror("chmod");
+  if (fchown(out_fd, hdr->uid, hdr->gid) < 0)
+    perror("chown");
+  struct timespec times[2];
+  times[0].tv_sec = hdr->mtime;
+  times[0].tv_nsec = 0;
+  times[1].tv_sec = hdr->mtime;
+  times[1].tv_nsec = 0;
+  if (futimens(out_fd, times) < 0)
+    perror("futimens");
+  close(out_fd);
+  return 0;
+}
+
+// Extracts every named member into dir_fd with one index load. The
+// archive is only read unless remove_extracted is set, in which case it
+// stays locked for update and each extracted entry is tombstoned before
+// the index is committed once, so nobody can replace a member between
+// its extraction and its removal.
+static int extract_files(const char *arch_path, char **names, size_t n,
+                         int dir_fd, int remove_extracted) {
+  struct archive_index idx;
+  int fd = remove_extracted ? open_for_update(arch_path, 0, &idx)
+                            : open_snapshot(arch_path, &idx);
+  if (fd < 0)
+    return 1;
+  // An explicit --copy-engine keeps the descriptor path.
+  const uint8_t *map =
+      copy_engine == COPY_AUTO ? map_archive(fd, idx.data_end) : NULL;
+  size_t nremoved = 0;
+  int rc = 0;
+  for (size_t i = 0; i < n; i++) {
+    struct index_entry *e = index_lookup(&idx, names[i]);
+    if (!e) {
+      fprintf(stderr, "file not found in archive: %s\n", names[i]);
+      rc = 1;
+      continue;
+    }
+    struct entry_header hdr;
+    uint64_t data_off;
+    if (resolve_data(&idx, e, &hdr, &data_off) < 0) {
+      rc = 1;
+      continue;
+    }
+    if (map) {
+      if (data_off + hdr.stored_len > idx.data_end) {
+        fprintf(stderr, "corrupt archive (truncated entry)\n");
+        rc = 1;
+        continue;
       }
+      advise_range(map, data_off, hdr.stored_len, MADV_WILLNEED);
+    } else if (lseek(fd, (off_t)data_off, SEEK_SET) == (off_t)-1) {
+      perror("lseek");
+      rc = 1;
+      continue;
+    }
+    if (write_member(fd, map ? map + data_off : NULL, dir_fd, names[i],
+                     &hdr) < 0) {
+      rc = 1;
+      continue;
+    }
+    if (remove_extracted) {
+      tombstone_entry(e);
+      nremoved++;
     }
-    free(name);
   }
+  if (map)
+    munmap((void *)map, (size_t)idx.data_end);
+  if (nremoved > 0 && commit_index(fd, &idx) < 0)
+    rc = 1;
+  index_free(&idx);
   close(fd);
-  if (!found) {
-    fprintf(stderr, "file not found in archive: %s\n", want_name);
+  return rc;
+}
+
+// Copies bytes [off, off + len) of a member to out_fd. Stored content is
+// read straight from its position. Compressed content is decoded from
+// the block holding off, located through the block table or, for
+// members written without one, by hopping over frame headers.
+static int extract_range(const char *arch_path, const char *name,
+                         uint64_t off, uint64_t len, int out_fd) {
+  struct archive_index idx;
+  int fd = open_snapshot(arch_path, &idx);
+  if (fd < 0)
+    return 1;
+  struct entry_header hdr;
+  uint64_t data_off;
+  struct index_entry *e = index_lookup(&idx, name);
+  if (!e) {
+    fprintf(stderr, "file not found in archive: %s\n", name);
+    index_free(&idx);
+    close(fd);
+    return 1;
+  }
+  if (resolve_data(&idx, e, &hdr, &data_off) < 0) {
+    index_free(&idx);
+    close(fd);
+    return 1;
+  }
+  index_free(&idx);
+  if (off > hdr.content_len) {
+    fprintf(stderr, "range starts past the end of %s (%lu bytes)\n", name,
+            (unsigned long)hdr.content_len);
+    close(fd);
+    return 1;
+  }
+  if (len > hdr.content_len - off)
+    len = hdr.content_len - off;
+
+  if (hdr.codec == CODEC_NONE) {
+    int rc = 0;
+    if (lseek(fd, (off_t)(data_off + off), SEEK_SET) == (off_t)-1 ||
+        copy_bytes(fd, out_fd, len) < 0) {
+      perror("read range");
+      rc = 1;
+    }
+    close(fd);
+    return rc;
+  }
+  if (!codec_available(hdr.codec)) {
+    fprintf(stderr, "codec %s is not built into this archiver\n",
+            codec_name(hdr.codec));
+    close(fd);
     return 1;
   }
-  return rewrite_without(arch_path, want_name, NULL, NULL);
+
+  uint64_t frames = frames_len(&hdr);
+  uint64_t first = off / BLOCK_SIZE;
+  uint64_t foff = 0; // offset of the current frame within the content
+  uint8_t fh[FRAME_HDR];
+  int rc = 0;
+  if (len > 0 && (hdr.flags & HDR_BLOCKS)) {
+    if (pread(fd, fh, 8, (off_t)(data_off + frames + 8 * first)) != 8)
+      rc = 1;
+    foff = get_u64(fh);
+  } else {
+    for (uint64_t k = 0; len > 0 && k < first && rc == 0; k++) {
+      if (foff + FRAME_HDR > frames ||
+          pread(fd, fh, FRAME_HDR, (off_t)(data_off + foff)) != FRAME_HDR)
+        rc = 1;
+      foff += FRAME_HDR + (get_u32(fh + 4) & ~FRAME_RAW);
+    }
+  }
+
+  uint8_t *in = (uint8_t *)malloc(BLOCK_BOUND);
+  uint8_t *raw = (uint8_t *)malloc(BLOCK_SIZE);
+  if (!in || !raw) {
+    perror("malloc");
+    rc = 1;
+  }
+  size_t skip = (size_t)(off - first * BLOCK_SIZE);
+  while (rc == 0 && len > 0) {
+    if (foff + FRAME_HDR > frames ||
+        pread(fd, fh, FRAME_HDR, (off_t)(data_off + foff)) != FRAME_HDR) {
+      rc = 1;
+      break;
+    }
+    uint32_t rlen = get_u32(fh);
+    uint32_t flen = get_u32(fh + 4) & ~FRAME_RAW;
+    int is_raw = (get_u32(fh + 4) & FRAME_RAW) != 0;
+    if (rlen > BLOCK_SIZE || flen > BLOCK_BOUND ||
+        flen > frames - foff - FRAME_HDR || (is_raw && flen != rlen) ||
+        skip >= rlen ||
+        pread(fd, in, flen, (off_t)(data_off + foff + FRAME_HDR)) !=
+            (ssize_t)flen) {
+      rc = 1;
+      break;
+    }
+    const uint8_t *data = in;
+    if (!is_raw) {
+      if (decompress_block(hdr.codec, in, flen, raw, BLOCK_SIZE) !=
+          (ssize_t)rlen) {
+        rc = 1;
+        break;
+      }
+      data = raw;
+    }
+    size_t take = rlen - skip;
+    if ((uint64_t)take > len)
+      take = (size_t)len;
+    if (write_full(out_fd, data + skip, take) < 0) {
+      perror("write");
+      rc = 1;
+      break;
+    }
+    len -= take;
+    skip = 0;
+    foff += FRAME_HDR + flen;
+  }
+  if (rc && in && raw)
+    fprintf(stderr, "corrupt archive (bad block in %s)\n", name);
+  free(in);
+  free(raw);
+  close(fd);
+  return rc;
 }
 
 static void print_help(const char *prog) {
   dprintf(STDOUT_FILENO,
           "Usage:\n"
-          "  %s ARCH -i|--input FILE\n"
-          "  %s ARCH -e|--extract FILE\n"
+          "  %s ARCH -i|--input FILE... [-T LIST]\n"
+          "  %s ARCH -e|--extract FILE... [-T LIST] [-C DIR]"
+          " [--remove]\n"
+          "  %s ARCH -e FILE --range OFF:[LEN]\n"
           "  %s ARCH -s|--stat\n"
+          "  %s ARCH --compact\n"
+          "  %s ARCH --verify [-j N]\n"
           "  %s -h|--help\n\n"
+          "Options:\n"
+          "  -T LIST     also take FILE names from LIST, one per line\n"
+          "              ('-' for stdin)\n"
+          "  --null      names in LIST are NUL-separated\n"
+          "  -C DIR      extract into DIR instead of the current directory\n"
+          "  --remove    delete extracted members from the archive\n"
+          "  --range OFF:[LEN]\n"
+          "      write LEN bytes of FILE from offset OFF to stdout (to the\n"
+          "      end without LEN); compressed members are entered at the\n"
+          "      right block.\n"
+          "  --codec=none|lz4|zstd|deflate\n"
+          "      compress new members in independent blocks (default none);\n"
+          "      zstd and deflate need the library at build time.\n"
+          "  -j N        compress and checksum (or --verify) with N worker\n"
+          "              threads; output is identical to a single-threaded\n"
+          "              run\n"
+          "  --dedup     store content already in the archive as a reference\n"
+          "              to the existing copy (SHA-256 match)\n"
+          "  --copy-engine=auto|rw|splice|cfr\n"
+          "      how content is copied: copy_file_range (cfr),\n"
+          "      sendfile/splice, or a read/write loop (rw); auto tries them\n"
+          "      in that order.\n\n"
           "Notes:\n"
-          "  - Archive format without compression.\n"
+          "  - Members are stored uncompressed unless --codec is given.\n"
           "  - Uses open/read/write/lseek.\n"
-          "  - Extract (-e) removes file from archive after writing.\n",
-          prog, prog, prog, prog);
+          "  - A directory FILE is added recursively; members keep their path\n"
+          "    relative to the directory's parent.\n"
+          "  - A trailing index locates members without scanning the\n"
+          "    archive; archives without it are still read by a linear\n"
+          "    scan.\n"
+          "  - Adding appends in place; replaced and extracted members are\n"
+          "    only marked deleted until --compact reclaims their space.\n"
+          "  - Extract (-e) only reads the archive unless --remove is given.\n"
+          "  - Many FILEs are added or extracted in one pass with a single\n"
+          "    index update.\n"
+          "  - Headers and content carry CRC32C checksums; --verify checks\n"
+          "    every entry.\n"
+          "  - Concurrent runs on one ARCH are safe: changes take an\n"
+          "    exclusive lock, readers a shared one only while loading the\n"
+          "    index.\n",
+          prog, prog, prog, prog, prog, prog, prog);
+}
+
+struct name_list {
+  char **v;
+  size_t n;
+  size_t cap;
+};
+
+static int name_list_add(struct name_list *l, const char *name, size_t len) {
+  if (l->n == l->cap) {
+    size_t ncap = l->cap ? l->cap * 2 : 16;
+    char **nv = (char **)realloc(l->v, ncap * sizeof(*nv));
+    if (!nv) {
+      perror("realloc");
+      return -1;
+    }
+    l->v = nv;
+    l->cap = ncap;
+  }
+  char *copy = (char *)malloc(len + 1);
+  if (!copy) {
+    perror("malloc");
+    return -1;
+  }
+  memcpy(copy, name, len);
+  copy[len] = '\0';
+  l->v[l->n++] = copy;
+  return 0;
+}
+
+static void name_list_free(struct name_list *l) {
+  for (size_t i = 0; i < l->n; i++)
+    free(l->v[i]);
+  free(l->v);
+}
+
+// Appends the names listed in path ("-" for stdin), separated by newlines
+// or by NULs. Empty names are skipped.
+static int read_name_list(struct name_list *l, const char *path, int nul_sep) {
+  FILE *fp = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+  if (!fp) {
+    perror(path);
+    return -1;
+  }
+  char *line = NULL;
+  size_t cap = 0;
+  ssize_t len;
+  int rc = 0;
+  int delim = nul_sep ? '\0' : '\n';
+  while ((len = getdelim(&line, &cap, delim, fp)) != -1) {
+    if (len > 0 && line[len - 1] == delim)
+      len--;
+    if (len > 0 && name_list_add(l, line, (size_t)len) < 0) {
+      rc = -1;
+      break;
+    }
+  }
+  if (ferror(fp)) {
+    perror(path);
+    rc = -1;
+  }
+  free(line);
+  if (fp != stdin)
+    fclose(fp);
+  return rc;
+}
+
+static int parse_codec(const char *s) {
+  for (int c = CODEC_NONE; c <= CODEC_DEFLATE; c++) {
+    if (!strcmp(s, codec_name(c))) {
+      if (!codec_available(c)) {
+        fprintf(stderr, "codec %s is not built into this archiver\n", s);
+        return -1;
+      }
+      codec = c;
+      return 0;
+    }
+  }
+  fprintf(stderr, "unknown codec: %s\n", s);
+  return -1;
+}
+
+static int parse_copy_engine(const char *s) {
+  if (!strcmp(s, "auto"))
+    copy_engine = COPY_AUTO;
+  else if (!strcmp(s, "rw"))
+    copy_engine = COPY_RW;
+  else if (!strcmp(s, "splice"))
+    copy_engine = COPY_SPLICE;
+  else if (!strcmp(s, "cfr"))
+    copy_engine = COPY_CFR;
+  else
+    return -1;
+  return 0;
+}
+
+// OFF:LEN or OFF: (to the end of the member).
+static int parse_range(const char *s, uint64_t *off, uint64_t *len) {
+  char *end;
+  if (*s < '0' || *s > '9')
+    return -1;
+  errno = 0;
+  *off = strtoull(s, &end, 10);
+  if (end == s || *end != ':' || errno)
+    return -1;
+  s = end + 1;
+  if (*s == '\0') {
+    *len = UINT64_MAX;
+    return 0;
+  }
+  if (*s < '0' || *s > '9')
+    return -1;
+  *len = strtoull(s, &end, 10);
+  if (end == s || *end || errno)
+    return -1;
+  return 0;
 }
 
 int main(int argc, char **argv) {
+  crc32c_init();
+
+  // Options may appear anywhere; strip them before the positional parse.
+  int nul_sep = 0;
+  int remove_extracted = 0;
+  const char *range = NULL;
+  const char *out_dir = NULL;
+  int jobs = 1;
+  int n = 1;
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "--dedup")) {
+      dedup = 1;
+      continue;
+    }
+    if (!strcmp(argv[i], "--null")) {
+      nul_sep = 1;
+      continue;
+    }
+    if (!strcmp(argv[i], "--remove")) {
+      remove_extracted = 1;
+      continue;
+    }
+    if (!strcmp(argv[i], "--range") && i + 1 < argc) {
+      range = argv[++i];
+      continue;
+    }
+    if (!strcmp(argv[i], "-C") && i + 1 < argc) {
+      out_dir = argv[++i];
+      continue;
+    }
+    if (!strcmp(argv[i], "-j") && i + 1 < argc) {
+      jobs = atoi(argv[++i]);
+      if (jobs < 1 || jobs > 1024) {
+        fprintf(stderr, "bad job count: %s\n", argv[i]);
+        return 1;
+      }
+      continue;
+    }
+    if (!strncmp(argv[i], "--codec=", 8)) {
+      if (parse_codec(argv[i] + 8) < 0)
+        return 1;
+      continue;
+    }
+    if (!strncmp(argv[i], "--copy-engine=", 14)) {
+      if (parse_copy_engine(argv[i] + 14) < 0) {
+        fprintf(stderr, "unknown copy engine: %s\n", argv[i] + 14);
+        return 1;
+      }
+      continue;
+    }
+    argv[n++] = argv[i];
+  }
+  argc = n;
+  argv[argc] = NULL;
+
   if (argc < 2) {
     print_help(argv[0]);
     return 1;
@@ -570,10 +3524,68 @@ int main(int argc, char **argv) {
 
   if (!strcmp(opt, "-s") || !strcmp(opt, "--stat")) {
     return list_archive(arch_path);
-  } else if ((!strcmp(opt, "-i") || !strcmp(opt, "--input")) && argc >= 4) {
-    return add_file(arch_path, argv[3]);
-  } else if ((!strcmp(opt, "-e") || !strcmp(opt, "--extract")) && argc >= 4) {
-    return extract_file(arch_path, argv[3]);
+  } else if (!strcmp(opt, "--compact")) {
+    return compact_archive(arch_path);
+  } else if (!strcmp(opt, "--verify")) {
+    return verify_archive(arch_path, jobs);
+  } else if (!strcmp(opt, "-i") || !strcmp(opt, "--input") ||
+             !strcmp(opt, "-e") || !strcmp(opt, "--extract")) {
+    int adding = !strcmp(opt, "-i") || !strcmp(opt, "--input");
+    if (range && adding) {
+      fprintf(stderr, "--range only applies to -e\n");
+      return 1;
+    }
+    struct name_list files = {NULL, 0, 0};
+    for (int i = 3; i < argc; i++) {
+      int rc = 0;
+      if (!strcmp(argv[i], "-T") && i + 1 < argc)
+        rc = read_name_list(&files, argv[++i], nul_sep);
+      else
+        rc = name_list_add(&files, argv[i], strlen(argv[i]));
+      if (rc < 0) {
+        name_list_free(&files);
+        return 1;
+      }
+    }
+    if (files.n == 0) {
+      name_list_free(&files);
+      print_help(argv[0]);
+      return 1;
+    }
+    int rc;
+    if (range) {
+      uint64_t off, len;
+      if (files.n != 1 || parse_range(range, &off, &len) < 0) {
+        fprintf(stderr, "--range needs one FILE and OFF:[LEN]\n");
+        name_list_free(&files);
+        return 1;
+      }
+      rc = extract_range(arch_path, files.v[0], off, len, STDOUT_FILENO);
+    } else if (adding) {
+      if (jobs > 1 && pool_start(jobs) < 0) {
+        pool_stop();
+        name_list_free(&files);
+        return 1;
+      }
+      rc = add_files(arch_path, files.v, files.n, jobs);
+      pool_stop();
+    } else {
+      int dir_fd = AT_FDCWD;
+      if (out_dir) {
+        dir_fd = open(out_dir, O_RDONLY | O_DIRECTORY);
+        if (dir_fd < 0) {
+          perror(out_dir);
+          name_list_free(&files);
+          return 1;
+        }
+      }
+      rc = extract_files(arch_path, files.v, files.n, dir_fd,
+                         remove_extracted);
+      if (dir_fd != AT_FDCWD)
+        close(dir_fd);
+    }
+    name_list_free(&files);
+    return rc;
   } else if (!strcmp(opt, "-h") || !strcmp(opt, "--help")) {
     print_help(argv[0]);
     return 0;